@@ -0,0 +1,486 @@
+#ifndef BATCHRUNNER_H
+#define BATCHRUNNER_H
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <map>
+#include <functional>
+#include "CrimeDatabase.h"
+#include "ResultWriter.h"
+#include "QueryTask.h"
+#include "WorkStealing.h"
+#include "DiskStore.h"
+
+using namespace std;
+
+// one line of a batch file. searches are "<area|street|year|record> <map|splay|versioned>
+// <argument>" or "year segments <year>", counts are "count <all|area|year|hour|month> [area=<name>;street=<name>;year=<year>]",
+// date range searches are "range <from>[..<to>] [area=<name>;time=<hhmm>-<hhmm>]" where
+// from and to are years or MM/DD/YYYY dates
+struct BatchQuery
+{
+    int line = 0;
+    string text;
+    bool isCount = false;
+    bool isRange = false;
+    RangeFilter range;
+    int type = 0;
+    int backend = 0;
+    string argument;
+    int group = 0;
+    CountFilter filter;
+    string error;
+};
+
+// first and last day of a year or a single MM/DD/YYYY date, false if it's neither
+inline bool parseRangeBound(const string& text, int& lo, int& hi)
+{
+    int year;
+    if (text.find('/') == string::npos) {
+        if (!parseInt(text, year) || year < 0 || year > 9999) {
+            return false;
+        }
+        lo = year * 10000 + 101;
+        hi = year * 10000 + 1231;
+        return true;
+    }
+    lo = hi = getDateKey(text);
+    return lo >= 0;
+}
+
+// parse one batch line, false for blank lines and # comments
+inline bool parseBatchLine(const string& raw, int lineNumber, BatchQuery& q)
+{
+    q = BatchQuery();
+    q.line = lineNumber;
+    q.text = removeExtraSpace(raw);
+    if (q.text.empty() || q.text[0] == '#') {
+        return false;
+    }
+    stringstream ss(q.text);
+    string kind, second;
+    ss >> kind >> second;
+    getline(ss, q.argument);
+    q.argument = removeExtraSpace(q.argument);
+    kind = toUpper(kind);
+    second = toUpper(second);
+
+    if (kind == "RANGE") {
+        q.isRange = true;
+        q.type = RANGE_QUERY;
+        q.backend = SEGMENT_BACKEND;
+        size_t dots = second.find("..");
+        string from = second.substr(0, dots), to = dots == string::npos ? from : second.substr(dots + 2);
+        int unused;
+        if (!parseRangeBound(from, q.range.dateLo, unused) || !parseRangeBound(to, unused, q.range.dateHi)) {
+            q.error = "bad date range";
+            return true;
+        }
+        stringstream filters(q.argument);
+        string part;
+        while (getline(filters, part, ';')) {
+            size_t eq = part.find('=');
+            if (removeExtraSpace(part).empty()) continue;
+            string name = eq == string::npos ? "" : toUpper(removeExtraSpace(part.substr(0, eq)));
+            string value = eq == string::npos ? "" : removeExtraSpace(part.substr(eq + 1));
+            size_t dash = value.find('-');
+            if (name == "AREA") {
+                q.filter.area = value;
+            } else if (name == "TIME" && dash != string::npos
+                       && (q.range.timeLo = getTimeOfDay(removeExtraSpace(value.substr(0, dash)))) >= 0
+                       && (q.range.timeHi = getTimeOfDay(removeExtraSpace(value.substr(dash + 1)))) >= 0) {
+                continue;
+            } else {
+                q.error = "unknown range filter";
+            }
+        }
+        return true;
+    }
+
+    if (kind == "COUNT") {
+        q.isCount = true;
+        string groups[] = {"", "ALL", "AREA", "YEAR", "HOUR", "MONTH"};
+        for (int g = COUNT_ALL; g <= COUNT_BY_MONTH; ++g) {
+            if (second == groups[g]) q.group = g;
+        }
+        if (q.group == 0) {
+            q.error = "unknown count group";
+            return true;
+        }
+        stringstream filters(q.argument);
+        string part;
+        while (getline(filters, part, ';')) {
+            size_t eq = part.find('=');
+            if (removeExtraSpace(part).empty()) continue;
+            string name = eq == string::npos ? "" : toUpper(removeExtraSpace(part.substr(0, eq)));
+            string value = eq == string::npos ? "" : part.substr(eq + 1);
+            if (name == "AREA") {
+                q.filter.area = value;
+            } else if (name == "STREET") {
+                q.filter.street = value;
+            } else if (name == "YEAR") {
+                q.filter.year = value;
+            } else {
+                q.error = "unknown count filter";
+            }
+        }
+        return true;
+    }
+
+    string types[] = {"", "AREA", "STREET", "YEAR", "RECORD"};
+    for (int t = AREA_QUERY; t <= RECORD_QUERY; ++t) {
+        if (kind == types[t]) q.type = t;
+    }
+    if (second == "MAP") {
+        q.backend = MAP_BACKEND;
+    } else if (second == "SPLAY" || second == "SPLAYTREE") {
+        q.backend = SPLAY_BACKEND;
+    } else if (second == "VERSIONED") {
+        q.backend = VERSIONED_BACKEND;
+    } else if (second == "SEGMENTS") {
+        q.backend = SEGMENT_BACKEND;
+    }
+    if (q.type == 0) {
+        q.error = "unknown query type";
+    } else if (q.backend == 0) {
+        q.error = "unknown data structure";
+    } else if (q.backend == SEGMENT_BACKEND && q.type != YEAR_QUERY) {
+        q.error = "segments only answer year searches";
+    }
+    return true;
+}
+
+// output line for a query: line | query | answer | latency
+inline string batchLine(const BatchQuery& q, const string& answer, long long ns)
+{
+    return to_string(q.line) + " | " + q.text + " | " + answer + " | " + to_string(ns) + " ns\n";
+}
+
+// one query being run a slice at a time. counts, cache hits, segment searches and record
+// lookups finish in their first step. uncached scans run as a search coroutine, or split into morsels
+// on a pool when one is given
+class BatchJob {
+private:
+    CrimeDatabase* db;
+    // keeps the snapshot db points into alive until the job is gone, when it came from a store
+    DatabasePin pin;
+    BatchQuery q;
+    QueryControl control;
+    size_t sliceSize;
+    WorkStealingPool* pool;
+    chrono::steady_clock::time_point start;
+    bool begun = false;
+    string cacheKey;
+    // dataset version the cache was checked at, the result is cached under it
+    uint64_t cacheVersion = 0;
+    SearchTask task;
+    string line;
+
+    void finishWith(const string& answer) {
+        long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        line = batchLine(q, answer, ns);
+        if (q.error.empty() && !q.isCount) {
+            db->metrics.recordQuery(q.type, q.backend, ns);
+        }
+    }
+
+    void finishSearch(SearchOutcome& outcome) {
+        if (outcome.status == QUERY_CANCELLED) {
+            finishWith("cancelled");
+        } else if (outcome.status == QUERY_TIMED_OUT) {
+            finishWith("timed out");
+        } else {
+            size_t found = outcome.ids.size();
+            if (!cacheKey.empty()) {
+                db->cache.put(cacheKey, cacheVersion, make_shared<const vector<int>>(move(outcome.ids)));
+            }
+            finishWith(to_string(found) + " results");
+        }
+    }
+
+public:
+    BatchJob(CrimeDatabase& database, const BatchQuery& query, QueryControl ctl = {},
+             size_t slice = DEFAULT_SLICE, WorkStealingPool* morselPool = nullptr)
+        : db(&database), q(query), control(ctl), sliceSize(slice), pool(morselPool) {}
+
+    // runs on the snapshot that was current when the job was made, a reload meanwhile
+    // doesn't change its answer
+    BatchJob(DatabasePin snapshot, const BatchQuery& query, QueryControl ctl = {},
+             size_t slice = DEFAULT_SLICE, WorkStealingPool* morselPool = nullptr)
+        : db(snapshot.get()), pin(move(snapshot)), q(query), control(ctl), sliceSize(slice), pool(morselPool) {}
+
+    // run the next slice, true once the output line is ready
+    bool step() {
+        TraceSpan span("batch.step");
+        if (!begun) {
+            begun = true;
+            start = chrono::steady_clock::now();
+            if (!q.error.empty()) {
+                finishWith("error: " + q.error);
+                return true;
+            }
+            if (q.isRange) {
+                RangeFilter range = q.range;
+                if (!removeExtraSpace(q.filter.area).empty()) {
+                    {
+                        shared_lock<RwLock> dataRead(db->dataLock);
+                        range.area = db->columns.areaCode(q.filter.area);
+                    }
+                    if (range.area < 0) {
+                        finishWith("0 results");
+                        return true;
+                    }
+                }
+                size_t scanned = 0;
+                size_t found = db->rangeSearch(range, &scanned).size();
+                finishWith(to_string(found) + " results (" + to_string(scanned) + " of " + to_string(db->size())
+                           + " rows scanned)");
+                return true;
+            }
+            if (q.isCount) {
+                string answer;
+                for (auto &row : db->countBy(q.group, q.filter)) {
+                    if (!answer.empty()) answer += ' ';
+                    answer += row.label + '=' + to_string(row.count);
+                }
+                finishWith(answer.empty() ? "none" : answer);
+                return true;
+            }
+            if (q.type != RECORD_QUERY) {
+                cacheKey = db->searchKey(q.type, q.argument, q.backend);
+                cacheVersion = db->version;
+                shared_ptr<const vector<int>> ids = db->cache.get(cacheKey, cacheVersion);
+                db->metrics.recordCache(bool(ids));
+                if (ids) {
+                    finishWith(to_string(ids->size()) + " results");
+                    return true;
+                }
+            }
+            if (q.backend == SEGMENT_BACKEND) {
+                // only the segments of the year are read
+                size_t scanned = 0;
+                auto ids = make_shared<const vector<int>>(db->yearSearch(q.argument, &scanned));
+                db->cache.put(cacheKey, cacheVersion, ids);
+                finishWith(to_string(ids->size()) + " results (" + to_string(scanned) + " of "
+                           + to_string(db->size()) + " rows scanned)");
+                return true;
+            }
+            if (pool && q.type != RECORD_QUERY) {
+                SearchOutcome outcome = db->parallelSearch(*pool, q.type, q.argument, q.backend, control);
+                finishSearch(outcome);
+                return true;
+            }
+            task = db->searchTask(q.type, q.argument, q.backend, control, sliceSize);
+        }
+        if (!task.step()) {
+            return false;
+        }
+        finishSearch(task.outcome());
+        return true;
+    }
+
+    // the finished output line: line | query | answer | latency
+    const string& output() const {
+        return line;
+    }
+};
+
+// run one query to the end and format its output line
+inline string runBatchQuery(CrimeDatabase& db, const BatchQuery& q, QueryControl control = {},
+                            WorkStealingPool* pool = nullptr)
+{
+    BatchJob job(db, q, control, DEFAULT_SLICE, pool);
+    while (!job.step()) {
+    }
+    return job.output();
+}
+
+// control for a query that has to finish within ms from now, no deadline for 0
+inline QueryControl deadlineFor(long long ms)
+{
+    QueryControl control;
+    if (ms > 0) {
+        control.deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+    }
+    return control;
+}
+
+// uncached area, street and year searches that share a type and backend are answered
+// together by one traversal instead of one scan each. their lines are filled in and
+// they are marked done. each group is a pool task when a pool is given. a query whose
+// argument can't match anything runs on its own. with a deadline a shared scan that
+// runs longer stops, and all of its queries are reported as timed out
+inline vector<bool> runSharedScans(CrimeDatabase& db, const vector<BatchQuery>& queries, vector<string>& lines,
+                                   WorkStealingPool* pool, long long deadlineMs = 0)
+{
+    vector<bool> handled(queries.size(), false);
+    map<pair<int, int>, vector<size_t>> groups;
+    uint64_t version = db.version;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const BatchQuery& q = queries[i];
+        if (!q.error.empty() || q.isCount || q.isRange || q.type == RECORD_QUERY || q.backend == SEGMENT_BACKEND) continue;
+        if (!SearchMatcher(q.type, q.argument).valid) continue;
+        if (db.cache.get(db.searchKey(q.type, q.argument, q.backend), version)) continue;
+        groups[{q.type, q.backend}].push_back(i);
+    }
+
+    vector<function<void()>> scans;
+    for (auto &g : groups) {
+        if (g.second.size() < 2) continue;
+        for (size_t i : g.second) handled[i] = true;
+        scans.push_back([&db, &queries, &lines, g, version, deadlineMs]() {
+            TraceSpan span("batch.sharedScan");
+            int type = g.first.first, backend = g.first.second;
+            auto start = chrono::steady_clock::now();
+            vector<string> arguments;
+            for (size_t i : g.second) arguments.push_back(queries[i].argument);
+            int status = QUERY_DONE;
+            vector<shared_ptr<const vector<int>>> results = db.sharedSearch(type, arguments, backend,
+                                                                            deadlineFor(deadlineMs), &status);
+            long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            for (size_t k = 0; k < g.second.size(); ++k) {
+                const BatchQuery& q = queries[g.second[k]];
+                db.metrics.recordCache(false);
+                db.metrics.recordQuery(q.type, q.backend, ns);
+                if (status != QUERY_DONE) {
+                    lines[g.second[k]] = batchLine(q, status == QUERY_CANCELLED ? "cancelled" : "timed out", ns);
+                    continue;
+                }
+                db.cache.put(db.searchKey(q.type, q.argument, q.backend), version, results[k]);
+                lines[g.second[k]] = batchLine(q, to_string(results[k]->size()) + " results (shared scan of "
+                                                  + to_string(g.second.size()) + ")", ns);
+            }
+        });
+    }
+    if (pool) {
+        for (auto &scan : scans) pool->submit(scan);
+        pool->waitIdle();
+    } else {
+        for (auto &scan : scans) scan();
+    }
+    return handled;
+}
+
+// read every query, run them back to back (or spread over threads) and write one
+// line per query in input order followed by a summary line. searches that can share a
+// scan run first. with a deadline a search
+// that runs longer is stopped and reported as timed out. false if the output couldn't
+// be written
+inline bool runBatch(CrimeDatabase& db, istream& in, int threads, ResultWriter& out, long long deadlineMs = 0)
+{
+    vector<BatchQuery> queries;
+    string line;
+    int lineNumber = 0;
+    while (getline(in, line)) {
+        BatchQuery q;
+        if (parseBatchLine(line, ++lineNumber, q)) {
+            queries.push_back(q);
+        }
+    }
+
+    vector<string> lines(queries.size());
+    auto start = chrono::steady_clock::now();
+    if (threads <= 1) {
+        vector<bool> handled = runSharedScans(db, queries, lines, nullptr, deadlineMs);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            if (handled[i]) continue;
+            lines[i] = runBatchQuery(db, queries[i], deadlineFor(deadlineMs));
+        }
+    } else {
+        // every query is a pool task and its scan is split into morsels, so workers that
+        // finish their own queries early steal morsels of the long ones
+        WorkStealingPool pool(static_cast<unsigned>(threads));
+        vector<bool> handled = runSharedScans(db, queries, lines, &pool, deadlineMs);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            if (handled[i]) continue;
+            pool.submit([&, i]() {
+                lines[i] = runBatchQuery(db, queries[i], deadlineFor(deadlineMs), &pool);
+            });
+        }
+        pool.waitIdle();
+    }
+    long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+    long long bytesBefore = out.bytesWritten();
+    for (auto &l : lines) {
+        out.text(l);
+    }
+    double seconds = ns / 1e9;
+    out.text("# " + to_string(queries.size()) + " queries in " + to_string(ns) + " ns, "
+             + to_string(seconds > 0 ? (long long)(queries.size() / seconds) : 0) + " queries/s\n");
+    bool flushed = out.flush();
+    db.metrics.bytesFormatted.fetch_add(uint64_t(out.bytesWritten() - bytesBefore), memory_order_relaxed);
+    return flushed;
+}
+
+#ifdef __linux__
+// run a batch against the out-of-core store. searches and date ranges read segment
+// columns through the buffer pool, the backend named in a search line doesn't matter.
+// counts need the in-memory indexes and are reported as errors. false if the output
+// couldn't be written
+inline bool runDiskBatch(DiskStore& store, istream& in, ResultWriter& out)
+{
+    vector<BatchQuery> queries;
+    string text;
+    int lineNumber = 0;
+    while (getline(in, text)) {
+        BatchQuery q;
+        if (parseBatchLine(text, ++lineNumber, q)) {
+            queries.push_back(q);
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<long long> ids;
+    for (auto &q : queries) {
+        auto begin = chrono::steady_clock::now();
+        string answer;
+        RangeFilter f = q.isRange ? q.range : RangeFilter();
+        int street = -1, value;
+        bool known = true;
+        if (!q.error.empty()) {
+            answer = "error: " + q.error;
+        } else if (q.isCount) {
+            answer = "error: counts need the in-memory store";
+        } else if (q.type == RECORD_QUERY) {
+            CrimeRecord rec;
+            answer = parseInt(q.argument, value) && store.record(value, rec) ? "1 results" : "0 results";
+        } else {
+            if (q.isRange) {
+                known = removeExtraSpace(q.filter.area).empty() || (f.area = store.areaCode(q.filter.area)) >= 0;
+            } else if (q.type == AREA_QUERY) {
+                known = (f.area = store.areaCode(q.argument)) >= 0;
+            } else if (q.type == STREET_QUERY) {
+                known = (street = store.streetCode(q.argument)) >= 0;
+            } else if ((known = parseInt(q.argument, value) && value >= 0)) {
+                f.dateLo = value * 10000 + 101;
+                f.dateHi = value * 10000 + 1231;
+            }
+            long long scanned = 0;
+            if (!known) {
+                answer = "0 results";
+            } else if (!store.search(f, street, ids, &scanned)) {
+                answer = "error: could not read a segment file";
+            } else {
+                answer = to_string(ids.size()) + " results (" + to_string(scanned) + " of "
+                       + to_string(store.size()) + " rows scanned)";
+            }
+        }
+        long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+        out.text(batchLine(q, answer, ns));
+    }
+    long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    double seconds = ns / 1e9;
+    SegmentPool& pool = store.buffers();
+    out.text("# " + to_string(queries.size()) + " queries in " + to_string(ns) + " ns, "
+             + to_string(seconds > 0 ? (long long)(queries.size() / seconds) : 0) + " queries/s\n");
+    out.text("# buffer pool: " + to_string(pool.maps) + " segment maps, " + to_string(pool.hits) + " hits, "
+             + to_string(pool.evictions) + " evictions, peak " + to_string(pool.peak) + " bytes mapped\n");
+    return out.flush();
+}
+#endif
+
+#endif //BATCHRUNNER_H
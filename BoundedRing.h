@@ -0,0 +1,163 @@
+#ifndef BOUNDEDRING_H
+#define BOUNDEDRING_H
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+
+// waits in a retry loop, spinning first, then yielding, then sleeping briefly so a stage
+// stuck behind a slower one doesn't burn its core
+class Backoff {
+private:
+    int tries = 0;
+
+public:
+    void pause() {
+        ++tries;
+        if (tries < 64) {
+            return;
+        } else if (tries < 256) {
+            this_thread::yield();
+        } else {
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+    }
+
+    void reset() {
+        tries = 0;
+    }
+};
+
+// bounded lock-free queue for any number of producers and consumers. every cell carries a
+// sequence number that tells a producer when the cell is free and a consumer when it
+// holds a value, so a push or pop is one compare-and-swap on the shared position plus
+// a store to the cell. capacity is rounded up to a power of two. push waits while the
+// ring is full, that is the backpressure on a stage running ahead of the next one
+template<typename T>
+class BoundedRing {
+private:
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    size_t mask;
+    unique_ptr<Cell[]> cells;
+    // producers and consumers each get their own cache line
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) atomic<size_t> tail{0};
+    alignas(64) atomic<bool> closed{false};
+    // pushes that found the ring full and pops that found it empty
+    atomic<uint64_t> fullWaits{0};
+    atomic<uint64_t> emptyWaits{0};
+
+public:
+    explicit BoundedRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mask = size - 1;
+        cells = make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    BoundedRing(const BoundedRing&) = delete;
+    BoundedRing& operator=(const BoundedRing&) = delete;
+
+    // false when the ring is full, value is only moved from on success
+    bool tryPush(T& value) {
+        size_t pos = head.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.value = move(value);
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // false when the ring is empty
+    bool tryPop(T& out) {
+        size_t pos = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    out = move(cell.value);
+                    cell.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // waits for room
+    void push(T value) {
+        if (tryPush(value)) {
+            return;
+        }
+        fullWaits.fetch_add(1, memory_order_relaxed);
+        Backoff backoff;
+        while (!tryPush(value)) {
+            backoff.pause();
+        }
+    }
+
+    // waits for a value, false once the ring is closed and drained
+    bool pop(T& out) {
+        if (tryPop(out)) {
+            return true;
+        }
+        emptyWaits.fetch_add(1, memory_order_relaxed);
+        Backoff backoff;
+        while (true) {
+            if (tryPop(out)) {
+                return true;
+            }
+            if (closed.load(memory_order_acquire)) {
+                // a push finished before the close is visible now
+                return tryPop(out);
+            }
+            backoff.pause();
+        }
+    }
+
+    // no more pushes, called once every producer is done
+    void close() {
+        closed.store(true, memory_order_release);
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    uint64_t fullCount() const {
+        return fullWaits.load(memory_order_relaxed);
+    }
+
+    uint64_t emptyCount() const {
+        return emptyWaits.load(memory_order_relaxed);
+    }
+};
+
+#endif //BOUNDEDRING_H
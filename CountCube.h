@@ -0,0 +1,228 @@
+#ifndef COUNTCUBE_H
+#define COUNTCUBE_H
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "CrimeColumns.h"
+#include "Trace.h"
+
+using namespace std;
+
+// dimensions of the cube, also used to pick what a roll up is grouped by
+enum CubeDim { CUBE_NONE = 0, CUBE_AREA = 1, CUBE_YEAR = 2, CUBE_MONTH = 3, CUBE_HOUR = 4 };
+
+// dense counts by area x year x month x hour with prefix sums along time (year, month),
+// so any slice or roll up is answered from the cells without touching the records.
+// an unknown year, month or hour (-1 in the columns) has a slot of its own after the
+// known ones, so every record is in a cell and totals match the posting lists
+class CountCube {
+private:
+    static const int MONTHS = 13;
+    static const int HOURS = 25;
+    int areas = 0;
+    int minYear = 0;
+    // known years, the unknown year slot comes after them
+    int years = 0;
+    // cell (a, t, h) where t = year slot * MONTHS + month slot
+    vector<long long> cells;
+    // prefix[(a, t, h)] = sum of cells (a, 0..t, h)
+    vector<long long> prefix;
+
+    int times() const {
+        return (years + 1) * MONTHS;
+    }
+    size_t at(int a, int t, int h) const {
+        return (size_t(a) * times() + t) * HOURS + h;
+    }
+    int yearSlot(int year) const {
+        return year < 0 ? years : year - minYear;
+    }
+    static int monthSlot(int month) {
+        return month < 1 || month > 12 ? MONTHS - 1 : month - 1;
+    }
+    static int hourSlot(int hour) {
+        return hour < 0 || hour > 23 ? HOURS - 1 : hour;
+    }
+    int timeOf(int year, int month) const {
+        return yearSlot(year) * MONTHS + monthSlot(month);
+    }
+
+    void buildPrefix(int a) {
+        for (int h = 0; h < HOURS; ++h) {
+            long long sum = 0;
+            for (int t = 0; t < times(); ++t) {
+                sum += cells[at(a, t, h)];
+                prefix[at(a, t, h)] = sum;
+            }
+        }
+    }
+
+    // grow to new dimensions, keeping the counts already in the cube
+    void resize(int newAreas, int newMinYear, int newYears) {
+        vector<long long> old;
+        old.swap(cells);
+        int oldAreas = areas, oldMin = minYear, oldYears = years;
+        areas = newAreas;
+        minYear = newMinYear;
+        years = newYears;
+        cells.assign(size_t(areas) * times() * HOURS, 0);
+        prefix.assign(cells.size(), 0);
+        for (int a = 0; a < oldAreas; ++a) {
+            for (int y = 0; y <= oldYears; ++y) {
+                int to = y == oldYears ? years : y + oldMin - minYear;
+                for (int m = 0; m < MONTHS; ++m) {
+                    for (int h = 0; h < HOURS; ++h) {
+                        cells[at(a, to * MONTHS + m, h)] = old[(size_t(a) * (oldYears + 1) * MONTHS + y * MONTHS + m) * HOURS + h];
+                    }
+                }
+            }
+        }
+        for (int a = 0; a < areas; ++a) {
+            buildPrefix(a);
+        }
+    }
+
+    // slots of a requested range: the known values in it, then the unknown slot if the
+    // range reaches down to -1
+    static vector<int> slots(int lo, int hi, int first, int count, int unknown) {
+        vector<int> out;
+        for (int v = max(lo, first); v <= hi && v < first + count; ++v) {
+            out.push_back(v - first);
+        }
+        if (lo <= -1 && hi >= -1) {
+            out.push_back(unknown);
+        }
+        return out;
+    }
+
+public:
+    // count every record in the columns, each thread fills a private cube for a
+    // slice of the records and the private cubes are summed
+    void build(const CrimeColumns& cols, unsigned threads = thread::hardware_concurrency())
+    {
+        areas = int(cols.areaNames.size());
+        minYear = cols.minYear;
+        years = cols.maxYear >= cols.minYear ? cols.maxYear - cols.minYear + 1 : 0;
+        cells.assign(size_t(areas) * times() * HOURS, 0);
+        prefix.assign(cells.size(), 0);
+
+        threads = max(1u, min(threads, unsigned(cols.size() / 65536 + 1)));
+        vector<vector<long long>> partial(threads, vector<long long>(cells.size(), 0));
+        vector<thread> workers;
+        size_t n = cols.size();
+        for (unsigned w = 0; w < threads; ++w) {
+            workers.emplace_back([&, w]() {
+                TraceSpan span("cube.count");
+                vector<long long>& local = partial[w];
+                size_t lo = n * w / threads, hi = n * (w + 1) / threads;
+                for (size_t i = lo; i < hi; ++i) {
+                    ++local[at(cols.area[i], timeOf(cols.year[i], cols.month[i]), hourSlot(cols.hour[i]))];
+                }
+            });
+        }
+        for (auto &t : workers) {
+            t.join();
+        }
+        for (unsigned w = 0; w < threads; ++w) {
+            for (size_t c = 0; c < cells.size(); ++c) {
+                cells[c] += partial[w][c];
+            }
+        }
+
+        // prefix sums, areas are independent
+        workers.clear();
+        for (unsigned w = 0; w < threads; ++w) {
+            workers.emplace_back([&, w]() {
+                TraceSpan span("cube.prefix");
+                for (int a = int(w); a < areas; a += int(threads)) {
+                    buildPrefix(a);
+                }
+            });
+        }
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+    // count one appended record, only the prefix sums after its month change
+    void add(int area, int year, int month, int hour)
+    {
+        if (year >= 0 && years == 0) {
+            resize(max(areas, area + 1), year, 1);
+        } else if (area >= areas || (year >= 0 && (year < minYear || year >= minYear + years))) {
+            int lo = year >= 0 ? min(minYear, year) : minYear;
+            int hi = year >= 0 ? max(minYear + years - 1, year) : minYear + years - 1;
+            resize(max(areas, area + 1), lo, hi - lo + 1);
+        }
+        int t = timeOf(year, month);
+        int h = hourSlot(hour);
+        ++cells[at(area, t, h)];
+        for (int u = t; u < times(); ++u) {
+            ++prefix[at(area, u, h)];
+        }
+    }
+
+    int areaCount() const {
+        return areas;
+    }
+    int firstYear() const {
+        return minYear;
+    }
+    int yearCount() const {
+        return years;
+    }
+
+    // counts over an area (-1 for all), inclusive year/month/hour ranges, grouped by a
+    // dimension. a range that reaches down to -1 takes in the unknown values as well.
+    // CUBE_NONE gives one total, otherwise one entry per area, year, month (1-12) or hour
+    // of the group dimension, with the unknown one last. totals over whole years come
+    // from the prefix sums
+    vector<long long> rollup(int area, int yearLo, int yearHi, int monthLo, int monthHi,
+                             int hourLo, int hourHi, int group) const
+    {
+        int groups = group == CUBE_AREA ? areas : group == CUBE_YEAR ? years + 1
+                   : group == CUBE_MONTH ? MONTHS : group == CUBE_HOUR ? HOURS : 1;
+        vector<long long> out(max(groups, 0), 0);
+        if (area >= areas) {
+            return out;
+        }
+        vector<int> yearSlots = slots(yearLo, yearHi, minYear, years, years);
+        vector<int> monthSlots = slots(monthLo, monthHi, 1, 12, MONTHS - 1);
+        vector<int> hourSlots = slots(hourLo, hourHi, 0, 24, HOURS - 1);
+        int aLo = area < 0 ? 0 : area;
+        int aHi = area < 0 ? areas - 1 : area;
+        bool wholeYears = int(monthSlots.size()) == MONTHS;
+
+        for (int a = aLo; a <= aHi; ++a) {
+            if (wholeYears && group != CUBE_YEAR && group != CUBE_MONTH) {
+                // year slots are ascending, each run of consecutive ones is one time
+                // range with two prefix lookups per hour
+                for (size_t i = 0; i < yearSlots.size();) {
+                    size_t j = i;
+                    while (j + 1 < yearSlots.size() && yearSlots[j + 1] == yearSlots[j] + 1) ++j;
+                    int tLo = yearSlots[i] * MONTHS, tHi = yearSlots[j] * MONTHS + MONTHS - 1;
+                    for (int h : hourSlots) {
+                        long long c = prefix[at(a, tHi, h)] - (tLo > 0 ? prefix[at(a, tLo - 1, h)] : 0);
+                        out[group == CUBE_AREA ? a : group == CUBE_HOUR ? h : 0] += c;
+                    }
+                    i = j + 1;
+                }
+                continue;
+            }
+            for (int y : yearSlots) {
+                for (int m : monthSlots) {
+                    int t = y * MONTHS + m;
+                    for (int h : hourSlots) {
+                        long long c = cells[at(a, t, h)];
+                        int g = group == CUBE_AREA ? a : group == CUBE_YEAR ? y
+                              : group == CUBE_MONTH ? m : group == CUBE_HOUR ? h : 0;
+                        out[g] += c;
+                    }
+                }
+            }
+        }
+        return out;
+    }
+};
+
+#endif //COUNTCUBE_H
@@ -0,0 +1,78 @@
+#ifndef CRIMECOLUMNS_H
+#define CRIMECOLUMNS_H
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "CrimeRecord.h"
+
+using namespace std;
+
+// dictionary encoded copy of the fields used for counting, one entry per record number.
+// small fixed width columns can be scanned without touching the record strings
+struct CrimeColumns
+{
+    // code -> display name, normalized name -> code
+    vector<string> areaNames;
+    unordered_map<string, int> areaCodes;
+    vector<string> streetNames;
+    unordered_map<string, int> streetCodes;
+
+    vector<uint16_t> area;
+    vector<int32_t> street;
+    vector<int16_t> year;   // -1 if the date didn't parse
+    vector<int8_t> month;   // 1-12, -1 if unknown
+    vector<int8_t> hour;    // 0-23, -1 if unknown
+
+    int minYear = 0;
+    int maxYear = -1;
+
+    int size() const {
+        return int(area.size());
+    }
+
+    void add(const CrimeRecord& rec)
+    {
+        area.push_back(uint16_t(encode(areaKey(rec.area), rec.area, areaCodes, areaNames)));
+        string streetName = removeLeadingNumber(rec.location);
+        street.push_back(encode(toUpper(streetName), streetName, streetCodes, streetNames));
+        year.push_back(int16_t(rec.year));
+        month.push_back(int8_t(getMonth(rec.date)));
+        hour.push_back(int8_t(getHour(rec.time)));
+
+        if (rec.year >= 0) {
+            if (maxYear < minYear) {
+                minYear = maxYear = rec.year;
+            } else {
+                minYear = min(minYear, rec.year);
+                maxYear = max(maxYear, rec.year);
+            }
+        }
+    }
+
+    // code for an area or street typed by the user, -1 if it never occurs
+    int areaCode(const string& query) const {
+        auto it = areaCodes.find(areaKey(query));
+        return it == areaCodes.end() ? -1 : it->second;
+    }
+
+    int streetCode(const string& query) const {
+        auto it = streetCodes.find(streetKey(query));
+        return it == streetCodes.end() ? -1 : it->second;
+    }
+
+private:
+    static int encode(const string& key, const string& name, unordered_map<string, int>& codes, vector<string>& names)
+    {
+        auto it = codes.find(key);
+        if (it != codes.end()) {
+            return it->second;
+        }
+        int code = int(names.size());
+        codes.emplace(key, code);
+        names.push_back(name);
+        return code;
+    }
+};
+
+#endif //CRIMECOLUMNS_H
@@ -0,0 +1,1150 @@
+#ifndef CRIMEDATABASE_H
+#define CRIMEDATABASE_H
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <csignal>
+#include <cstdint>
+#include <atomic>
+#include "CrimeRecord.h"
+#include "CrimeColumns.h"
+#include "CrimeIndex.h"
+#include "CountCube.h"
+#include "Segments.h"
+#include "TopK.h"
+#include "QueryCache.h"
+#include "QueryTask.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "MemoryStats.h"
+#include "SplayTree.h"
+#include "PersistentTree.h"
+#include "Snapshot.h"
+#include "RwLock.h"
+
+using namespace std;
+
+// search types, numbered like the menu options. date ranges come from batch lines only
+enum QueryType { AREA_QUERY = 1, STREET_QUERY = 2, YEAR_QUERY = 3, RECORD_QUERY = 4, RANGE_QUERY = 5 };
+
+// data structure used to answer a search, numbered like the menu options. the time
+// segments only answer year and range searches, the trees everything else
+enum Backend { MAP_BACKEND = 1, SPLAY_BACKEND = 2, VERSIONED_BACKEND = 3, SEGMENT_BACKEND = 4 };
+
+// when load builds the map, splay tree and versioned tree. the record store, columns and
+// indexes are always built by load, a search on a tree that isn't ready scans them instead
+enum TreeMode { TREES_AT_LOAD = 0, TREES_BACKGROUND = 1, TREES_LAZY = 2 };
+
+enum TreeState { TREE_PENDING = 0, TREE_BUILDING = 1, TREE_READY = 2 };
+
+// build state of one tree, built counts the records in it so far
+struct TreeBuild
+{
+    atomic<int> state{TREE_PENDING};
+    atomic<long long> built{0};
+    atomic<long long> total{0};
+};
+
+// count groupings, numbered like the count menu
+enum CountGroup { COUNT_ALL = 1, COUNT_BY_AREA = 2, COUNT_BY_YEAR = 3, COUNT_BY_HOUR = 4, COUNT_BY_MONTH = 5 };
+
+// filters for a count, a blank field matches everything
+struct CountFilter
+{
+    string area;
+    string street;
+    string year;
+};
+
+// one line of a count result
+struct CountRow
+{
+    string label;
+    long long count;
+};
+
+// counting scan, adds match(i) to the bucket groupOf(i) for every record.
+// the match is added instead of branched on so the loop stays tight, the last bucket
+// collects group values outside the range
+template<typename Group, typename Match>
+void countScan(size_t n, Group groupOf, Match match, vector<long long>& buckets)
+{
+    size_t sink = buckets.size() - 1;
+    for (size_t i = 0; i < n; ++i) {
+        size_t b = groupOf(i);
+        b = b < sink ? b : sink;
+        buckets[b] += match(i);
+    }
+}
+
+// compares records against a normalized area, street or year query
+struct SearchMatcher
+{
+    int type;
+    string Q;
+    int year = 0;
+    bool valid = true;
+
+    SearchMatcher(int queryType, const string& query) : type(queryType) {
+        if (type == AREA_QUERY) {
+            Q = areaKey(query);
+        } else if (type == STREET_QUERY) {
+            Q = streetKey(query);
+        } else if (type != YEAR_QUERY || !parseInt(query, year)) {
+            valid = false;
+        }
+    }
+
+    bool operator()(const CrimeRecord& r) const {
+        if (type == AREA_QUERY) {
+            return areaKey(r.area) == Q;
+        } else if (type == STREET_QUERY) {
+            return toUpper(removeLeadingNumber(r.location)) == Q;
+        }
+        return r.year == year;
+    }
+};
+
+// one csv line into a record the way load reads it, for rows that arrive after load.
+// false if the date isn't one
+inline bool parseCrimeLine(const string& line, CrimeRecord& rec)
+{
+    stringstream ss(line);
+    string skip;
+    getline(ss, rec.date, ',');
+    getline(ss, rec.time, ',');
+    getline(ss, rec.area, ',');
+    for (int c = 0; c < 3; ++c) {
+        getline(ss, skip, ',');
+    }
+    getline(ss, rec.location, ',');
+    rec.area = removeExtraSpace(rec.area);
+    rec.location = removeExtraSpace(rec.location);
+    rec.year = getYear(rec.date);
+    return getDateKey(rec.date) >= 0;
+}
+
+struct CrimeDatabase
+{
+    // red black tree implementation as a map
+    map<int, CrimeRecord> rbTree;
+    SplayTree<int, CrimeRecord> splayTree;
+    // find splays the tree, so lookups need it exclusively while traversals can share it
+    shared_mutex splayLock;
+    // every append batch is a new version, searches on it pin one and take no lock
+    PersistentTree<int, CrimeRecord> versionedTree;
+    // set before load. unless the trees are built at load, searches on a tree scan the
+    // record store until it is ready. indexed by backend
+    int treeMode = TREES_AT_LOAD;
+    TreeBuild trees[4];
+    // background tree builds, joined on destruction
+    mutex builderLock;
+    vector<thread> builders;
+    // appends hold this exclusively, queries share it while they read the records, trees
+    // or indexes. scans take it per slice or morsel so an append can go in between, and
+    // a waiting append goes ahead of queries that arrive after it. taken before splayLock
+    mutable RwLock dataLock;
+    // record store, position is the record number
+    vector<pair<int, CrimeRecord>> allRecords;
+    CrimeColumns columns;
+    CrimeIndex index;
+    CountCube cube;
+    // record numbers by year and month with zone maps, for date range searches
+    SegmentStore segments;
+    // approximate street heavy hitters per area, kept current on append
+    StreamingTopK streetStream{256};
+    // recent search results, bumping version on any change invalidates them
+    QueryCache cache;
+    atomic<uint64_t> version{0};
+    // records visible to queries, set once a load or an append is complete
+    atomic<int> recordCount{0};
+    // bytes of the csv's complete lines that load read, where following the same file
+    // picks up. loadedPartial says load also took a last line that had no newline yet
+    long long loadedBytes = 0;
+    bool loadedPartial = false;
+    // latency histograms and counters per query type and backend. a reloaded dataset
+    // shares them with the one it replaces, so they cover the whole run
+    shared_ptr<QueryMetrics> metricsOwner = make_shared<QueryMetrics>();
+    QueryMetrics& metrics = *metricsOwner;
+    // resident memory at its peak during load and once load finished
+    long long loadPeakRss = 0;
+    long long loadedRss = 0;
+
+    CrimeDatabase() = default;
+
+    explicit CrimeDatabase(shared_ptr<QueryMetrics> shared) : metricsOwner(move(shared)) {}
+
+    ~CrimeDatabase() {
+        vector<thread> running;
+        {
+            lock_guard<mutex> guard(builderLock);
+            running.swap(builders);
+        }
+        for (auto &t : running) {
+            t.join();
+        }
+    }
+
+    CrimeDatabase(const CrimeDatabase&) = delete;
+    CrimeDatabase& operator=(const CrimeDatabase&) = delete;
+
+    // load csv file, false if it can't be opened
+    bool load(const string& path)
+    {
+        ifstream file(path);
+        if (!file)
+        {
+            return false;
+        }
+        // skip header line. a last line without its newline is loaded but left out of
+        // loadedBytes, it may still be being written
+        string line;
+        getline(file, line);
+        loadedBytes = file.eof() ? 0 : (long long)line.size() + 1;
+
+        int count = 0;
+
+        // lines go through each step a block at a time, so every step shows up as one
+        // span per block in a trace
+        const size_t BLOCK = 4096;
+        vector<string> lines;
+        vector<CrimeRecord> recs;
+        while (true)
+        {
+            TraceSpan blockSpan("load.block");
+            lines.clear();
+            {
+                TraceSpan span("load.read");
+                while (lines.size() < BLOCK && getline(file, line)) {
+                    if (file.eof()) {
+                        loadedPartial = true;
+                    } else {
+                        loadedBytes += (long long)line.size() + 1;
+                    }
+                    lines.push_back(move(line));
+                }
+            }
+            if (lines.empty()) {
+                break;
+            }
+
+            recs.assign(lines.size(), CrimeRecord());
+            {
+                TraceSpan span("load.split");
+                for (size_t i = 0; i < lines.size(); ++i) {
+                    stringstream ss(lines[i]);
+                    CrimeRecord& rec = recs[i];
+                    string skip;
+
+                    // taking in data from csv
+                    getline(ss, rec.date, ','); // date occurred
+                    getline(ss, rec.time, ','); // time occurred
+                    getline(ss, rec.area, ','); // area
+                    // skip columns to get to location column
+                    for (int c = 0; c < 3; ++c) {
+                        getline(ss, skip, ',');
+                    }
+                    getline(ss, rec.location, ',');
+                }
+            }
+            {
+                TraceSpan span("load.removeExtraSpace");
+                for (auto &rec : recs) {
+                    rec.area = removeExtraSpace(rec.area);
+                    rec.location = removeExtraSpace(rec.location);
+                }
+            }
+            {
+                TraceSpan span("load.getYear");
+                for (auto &rec : recs) {
+                    rec.year = getYear(rec.date);
+                }
+            }
+            if (treeMode == TREES_AT_LOAD) {
+                // insert into map
+                TraceSpan span("load.mapInsert");
+                MemoryScope scope(MEM_MAP);
+                for (size_t i = 0; i < recs.size(); ++i) {
+                    rbTree[count + int(i)] = recs[i];
+                }
+            }
+            {
+                // insert into splay tree
+                TraceSpan span("load.recordStore");
+                MemoryScope scope(MEM_RECORDS);
+                for (size_t i = 0; i < recs.size(); ++i) {
+                    allRecords.push_back(make_pair(count + int(i), recs[i]));
+                }
+            }
+            {
+                // columns and secondary indexes for counting
+                TraceSpan span("load.columns");
+                for (size_t i = 0; i < recs.size(); ++i) {
+                    {
+                        MemoryScope scope(MEM_COLUMNS);
+                        columns.add(recs[i]);
+                    }
+                    {
+                        MemoryScope scope(MEM_INDEX);
+                        index.add(count, columns);
+                    }
+                    {
+                        MemoryScope scope(MEM_TOPK);
+                        streetStream.add(columns.area[count], columns.street[count]);
+                    }
+                    {
+                        MemoryScope scope(MEM_SEGMENTS);
+                        segments.add(count, getDateKey(recs[i].date), getTimeOfDay(recs[i].time), columns.area[count]);
+                    }
+                    ++count;
+                }
+            }
+        }
+        file.close();
+
+        // build balanced splay tree and the versioned tree
+        if (treeMode == TREES_AT_LOAD) {
+            treeLoaded(MAP_BACKEND);
+            buildTree(SPLAY_BACKEND);
+            buildTree(VERSIONED_BACKEND);
+        }
+        // count cube for dashboards
+        {
+            TraceSpan span("load.cubeBuild");
+            MemoryScope scope(MEM_CUBE);
+            cube.build(columns);
+        }
+        recordCount.store(int(allRecords.size()), memory_order_release);
+        residentMemory(loadedRss, loadPeakRss);
+        if (treeMode == TREES_BACKGROUND) {
+            startTreeBuilds({MAP_BACKEND, SPLAY_BACKEND, VERSIONED_BACKEND});
+        }
+        return true;
+    }
+
+    // mark a tree the load filled as it went
+    void treeLoaded(int backend)
+    {
+        trees[backend].total = trees[backend].built = (long long)allRecords.size();
+        trees[backend].state.store(TREE_READY, memory_order_release);
+    }
+
+    // build one tree from the record store, unless it is built or being built
+    void buildTree(int backend)
+    {
+        int expected = TREE_PENDING;
+        if (trees[backend].state.compare_exchange_strong(expected, TREE_BUILDING)) {
+            buildClaimedTree(backend);
+        }
+    }
+
+    // build a tree this thread moved to TREE_BUILDING. dataLock is held shared for
+    // DEFAULT_SLICE records at a time, so an append waiting for it, and the queries behind
+    // that append, only wait for one slice. the records there were at the start go into
+    // the splay and versioned trees middle first, then left and right, so those come out
+    // balanced. rows appended meanwhile go in after them. the tree is marked ready under
+    // the lock once it holds every record, appends after that add to it
+    void buildClaimedTree(int backend)
+    {
+        TreeBuild& build = trees[backend];
+        TraceSpan span(backend == MAP_BACKEND ? "load.mapBuild" : backend == SPLAY_BACKEND ? "load.buildBalanced"
+                                                                                          : "load.versionedBuild");
+        MemoryScope scope(backend == MAP_BACKEND ? MEM_MAP : backend == SPLAY_BACKEND ? MEM_SPLAY : MEM_VERSIONED);
+        // index ranges still to insert middle first, and the next record after them
+        vector<pair<int, int>> ranges;
+        size_t next = 0;
+        if (backend != MAP_BACKEND) {
+            shared_lock<RwLock> dataRead(dataLock);
+            next = allRecords.size();
+            if (next > 0) ranges.push_back({0, int(next) - 1});
+        }
+        while (true) {
+            shared_lock<RwLock> dataRead(dataLock);
+            unique_lock<shared_mutex> splayWrite(splayLock, defer_lock);
+            if (backend == SPLAY_BACKEND) {
+                splayWrite.lock();
+            }
+            build.total = (long long)allRecords.size();
+            size_t added = 0;
+            for (; added < DEFAULT_SLICE && !ranges.empty(); ++added) {
+                auto [low, high] = ranges.back();
+                ranges.pop_back();
+                int mid = low + (high - low) / 2;
+                if (mid < high) ranges.push_back({mid + 1, high});
+                if (low < mid) ranges.push_back({low, mid - 1});
+                const pair<int, CrimeRecord>& p = allRecords[mid];
+                if (backend == SPLAY_BACKEND) {
+                    splayTree.rawInsert(p.first, p.second);
+                } else {
+                    versionedTree.insert(p.first, p.second);
+                }
+            }
+            // keys only grow from here, so every map insert goes at the end
+            for (; added < DEFAULT_SLICE && ranges.empty() && next < allRecords.size(); ++added, ++next) {
+                const pair<int, CrimeRecord>& p = allRecords[next];
+                if (backend == MAP_BACKEND) {
+                    rbTree.emplace_hint(rbTree.end(), p.first, p.second);
+                } else if (backend == SPLAY_BACKEND) {
+                    splayTree.insert(p.first, p.second);
+                } else {
+                    versionedTree.insert(p.first, p.second);
+                }
+            }
+            build.built.fetch_add((long long)added, memory_order_relaxed);
+            if (ranges.empty() && next == allRecords.size()) {
+                if (backend == VERSIONED_BACKEND) {
+                    versionedTree.commit();
+                }
+                build.state.store(TREE_READY, memory_order_release);
+                return;
+            }
+        }
+    }
+
+    // build the trees one after another on a background thread, skipping any that are
+    // built or being built
+    void startTreeBuilds(vector<int> backends)
+    {
+        vector<int> claimed;
+        for (int backend : backends) {
+            int expected = TREE_PENDING;
+            if (trees[backend].state.compare_exchange_strong(expected, TREE_BUILDING)) {
+                claimed.push_back(backend);
+            }
+        }
+        if (claimed.empty()) {
+            return;
+        }
+        lock_guard<mutex> guard(builderLock);
+        builders.emplace_back([this, claimed]() {
+#ifdef __linux__
+            // signals stay with the main thread, the server takes them through a signalfd
+            sigset_t all;
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, nullptr);
+#endif
+            for (int backend : claimed) {
+                buildClaimedTree(backend);
+            }
+        });
+    }
+
+    // whether a tree can answer searches, without starting its build
+    bool treeBuilt(int backend) const
+    {
+        return trees[backend].state.load(memory_order_acquire) == TREE_READY;
+    }
+
+    // whether a search on a backend can use its tree. in lazy mode the first search on a
+    // tree starts building it, searches scan the record store until it is ready
+    bool useTree(int backend)
+    {
+        int state = trees[backend].state.load(memory_order_acquire);
+        if (state == TREE_PENDING && treeMode == TREES_LAZY) {
+            startTreeBuilds({backend});
+        }
+        return state == TREE_READY;
+    }
+
+    // progress of the tree builds, empty once every tree is ready
+    string treeProgress() const
+    {
+        static const char* names[] = {"", "map", "splay tree", "versioned tree"};
+        string out;
+        bool building = false;
+        for (int backend = MAP_BACKEND; backend <= VERSIONED_BACKEND; ++backend) {
+            const TreeBuild& build = trees[backend];
+            int state = build.state.load(memory_order_acquire);
+            out += string(out.empty() ? "" : ", ") + names[backend];
+            if (state == TREE_READY) {
+                out += " ready";
+            } else if (state == TREE_PENDING) {
+                building = true;
+                out += treeMode == TREES_LAZY ? " on first search" : " waiting";
+            } else {
+                building = true;
+                out += " " + to_string(build.built * 100 / max(build.total.load(), 1LL)) + "%";
+            }
+        }
+        return building ? out : "";
+    }
+
+    int size() const {
+        return recordCount.load(memory_order_acquire);
+    }
+
+    // fetch a record by record number, only done when a result is printed
+    const CrimeRecord& record(int id) const {
+        return allRecords[id].second;
+    }
+
+    // run a search and return the matching record numbers, no record is copied
+    vector<int> search(int type, const string& query, int backend)
+    {
+        return move(searchTask(type, query, backend).finish().ids);
+    }
+
+    // search as a coroutine that suspends after every sliceSize records it scans, so a
+    // scheduler can interleave it with other queries. locks are only held within a slice
+    // and the scan continues after the last key it saw. stops early once control says so.
+    // a search started before its tree is ready reads the record store instead
+    SearchTask searchTask(int type, string query, int backend, QueryControl control = {}, size_t sliceSize = SIZE_MAX)
+    {
+        SearchOutcome outcome;
+        vector<int>& results = outcome.ids;
+
+        if (type == RECORD_QUERY) {
+            // by Record Number
+            TraceSpan span("search.record");
+            int recordNumber;
+            if (!parseInt(query, recordNumber)) {
+                co_return outcome;
+            }
+            bool tree = useTree(backend);
+            if (tree && backend == VERSIONED_BACKEND) {
+                if (versionedTree.pin().find(recordNumber)) results.push_back(recordNumber);
+                metrics.recordScan(type, backend, 1, results.size());
+                co_return outcome;
+            }
+            shared_lock<RwLock> dataRead(dataLock);
+            if (!tree) {
+                if (recordNumber >= 0 && recordNumber < int(allRecords.size())) results.push_back(recordNumber);
+            } else if (backend == MAP_BACKEND) {
+                auto it = rbTree.find(recordNumber);
+                if (it != rbTree.end()) results.push_back(it->first);
+            } else {
+                unique_lock<shared_mutex> writeLock(splayLock);
+                if (splayTree.find(recordNumber)) results.push_back(recordNumber);
+            }
+            metrics.recordScan(type, backend, 1, results.size());
+            co_return outcome;
+        }
+
+        // by Area, Street or Year
+        SearchMatcher matches(type, query);
+        if (!matches.valid) {
+            co_return outcome;
+        }
+
+        // the whole scan reads one version, appends meanwhile go into later ones
+        bool tree = useTree(backend);
+        PersistentTree<int, CrimeRecord>::View version;
+        if (tree && backend == VERSIONED_BACKEND) {
+            version = versionedTree.pin();
+        }
+        int last = 0;
+        bool started = false;
+        bool more = true;
+        uint64_t scanned = 0;
+        while (more) {
+            if ((outcome.status = control.check()) != QUERY_RUNNING) {
+                metrics.recordScan(type, backend, scanned, 0);
+                co_return outcome;
+            }
+            TraceSpan span("search.slice");
+            // the versioned tree reads its pinned version and leaves appends alone
+            shared_lock<RwLock> dataRead(dataLock, defer_lock);
+            if (!tree || backend != VERSIONED_BACKEND) {
+                dataRead.lock();
+            }
+            if (!tree) {
+                size_t i = started ? size_t(last) + 1 : 0;
+                size_t seen = 0;
+                for (; i < allRecords.size() && seen < sliceSize; ++i, ++seen) {
+                    if (matches(allRecords[i].second))
+                        results.push_back(int(i));
+                    last = int(i);
+                }
+                scanned += seen;
+                more = i < allRecords.size();
+            } else if (backend == MAP_BACKEND) {
+                auto it = started ? rbTree.upper_bound(last) : rbTree.begin();
+                size_t seen = 0;
+                for (; it != rbTree.end() && seen < sliceSize; ++it, ++seen) {
+                    if (matches(it->second))
+                        results.push_back(it->first);
+                    last = it->first;
+                }
+                scanned += seen;
+                more = it != rbTree.end();
+            } else if (backend == SPLAY_BACKEND) {
+                shared_lock<shared_mutex> readLock(splayLock);
+                more = splayTree.forEachAfter(started ? &last : nullptr, sliceSize, [&](int k, CrimeRecord& r){
+                    if (matches(r))
+                        results.push_back(k);
+                    last = k;
+                    ++scanned;
+                });
+            } else {
+                more = version.forEachAfter(started ? &last : nullptr, sliceSize, [&](int k, const CrimeRecord& r){
+                    if (matches(r))
+                        results.push_back(k);
+                    last = k;
+                    ++scanned;
+                });
+            }
+            started = true;
+            if (dataRead.owns_lock()) {
+                dataRead.unlock();
+            }
+            span.end();
+            if (more) {
+                co_yield 0;
+            }
+        }
+        outcome.status = QUERY_DONE;
+        metrics.recordScan(type, backend, scanned, results.size());
+        co_return outcome;
+    }
+
+    // search with the scan split into morsels of record numbers run on a task pool,
+    // idle workers steal morsels. results come back in record number order
+    template<typename Pool>
+    SearchOutcome parallelSearch(Pool& pool, int type, const string& query, int backend,
+                                 QueryControl control = {}, size_t morsel = 16384)
+    {
+        SearchOutcome outcome;
+        SearchMatcher matches(type, query);
+        if (!matches.valid) {
+            outcome.ids = search(type, query, backend);
+            return outcome;
+        }
+        // every morsel of a versioned search reads the same pinned version
+        bool tree = useTree(backend);
+        PersistentTree<int, CrimeRecord>::View version;
+        if (tree && backend == VERSIONED_BACKEND) {
+            version = versionedTree.pin();
+        }
+        size_t n = tree && backend == VERSIONED_BACKEND ? version.size() : size_t(size());
+        vector<vector<int>> parts((n + morsel - 1) / morsel);
+        atomic<int> stopped{QUERY_RUNNING};
+        atomic<uint64_t> scanned{0};
+        pool.parallelFor(n, morsel, [&](size_t lo, size_t hi) {
+            int status = control.check();
+            if (status != QUERY_RUNNING) {
+                stopped = status;
+                return;
+            }
+            TraceSpan span("search.morsel");
+            scanned.fetch_add(hi - lo, memory_order_relaxed);
+            vector<int>& part = parts[lo / morsel];
+            int before = int(lo) - 1;
+            if (tree && backend == VERSIONED_BACKEND) {
+                version.forEachAfter(lo > 0 ? &before : nullptr, hi - lo, [&](int k, const CrimeRecord& r){
+                    if (k < int(hi) && matches(r))
+                        part.push_back(k);
+                });
+                return;
+            }
+            shared_lock<RwLock> dataRead(dataLock);
+            if (!tree) {
+                for (size_t i = lo; i < hi && i < allRecords.size(); ++i) {
+                    if (matches(allRecords[i].second))
+                        part.push_back(int(i));
+                }
+            } else if (backend == MAP_BACKEND) {
+                for (auto it = rbTree.lower_bound(int(lo)); it != rbTree.end() && it->first < int(hi); ++it) {
+                    if (matches(it->second))
+                        part.push_back(it->first);
+                }
+            } else {
+                shared_lock<shared_mutex> readLock(splayLock);
+                splayTree.forEachAfter(lo > 0 ? &before : nullptr, hi - lo, [&](int k, CrimeRecord& r){
+                    if (k < int(hi) && matches(r))
+                        part.push_back(k);
+                });
+            }
+        });
+        if (stopped != QUERY_RUNNING) {
+            metrics.recordScan(type, backend, scanned, 0);
+            outcome.status = stopped;
+            return outcome;
+        }
+        size_t total = 0;
+        for (auto &part : parts) total += part.size();
+        metrics.recordScan(type, backend, scanned, total);
+        outcome.ids.reserve(total);
+        for (auto &part : parts) {
+            outcome.ids.insert(outcome.ids.end(), part.begin(), part.end());
+        }
+        return outcome;
+    }
+
+    // many area, street or year searches on one backend in a single traversal. each
+    // distinct normalized query gets a slot, looked up once by its dictionary code, and every
+    // visited record is routed to its slot by the record's code. results per input query.
+    // control is checked every DEFAULT_SLICE records, if it stops the traversal status is
+    // set to why and no results come back, otherwise to QUERY_DONE
+    vector<shared_ptr<const vector<int>>> sharedSearch(int type, const vector<string>& queries, int backend,
+                                                       QueryControl control = {}, int* status = nullptr)
+    {
+        TraceSpan span("search.shared");
+        shared_lock<RwLock> dataRead(dataLock);
+        // normalized key -> slot, duplicates share one
+        unordered_map<string, int> slotOfKey;
+        vector<int> querySlot(queries.size(), -1);
+        // dictionary code (or year - minYear) -> slot
+        size_t codes = type == AREA_QUERY ? columns.areaNames.size()
+                     : type == STREET_QUERY ? columns.streetNames.size()
+                     : size_t(max(columns.maxYear - columns.minYear + 1, 0));
+        vector<int> slotOfCode(codes, -1);
+        int slots = 0;
+        for (size_t i = 0; i < queries.size(); ++i) {
+            int code = -1, year;
+            if (type == AREA_QUERY) {
+                code = columns.areaCode(queries[i]);
+            } else if (type == STREET_QUERY) {
+                code = columns.streetCode(queries[i]);
+            } else if (type == YEAR_QUERY && parseInt(queries[i], year) && year >= columns.minYear && year <= columns.maxYear) {
+                code = year - columns.minYear;
+            }
+            if (code < 0) continue;
+            auto it = slotOfKey.emplace(normalizedQuery(type, queries[i]), slots).first;
+            if (it->second == slots) {
+                slotOfCode[code] = slots++;
+            }
+            querySlot[i] = it->second;
+        }
+
+        vector<vector<int>> buffers(slots);
+        auto route = [&](int id) {
+            int code = type == AREA_QUERY ? int(columns.area[id])
+                     : type == STREET_QUERY ? int(columns.street[id])
+                     : int(columns.year[id]) - columns.minYear;
+            if (code >= 0 && code < int(codes)) {
+                int slot = slotOfCode[code];
+                if (slot >= 0) buffers[slot].push_back(id);
+            }
+        };
+        int stopped = QUERY_RUNNING;
+        auto keepGoing = [&]() {
+            return (stopped = control.check()) == QUERY_RUNNING;
+        };
+        if (slots > 0) {
+            if (!useTree(backend)) {
+                for (size_t i = 0; i < allRecords.size(); ++i) {
+                    if (i % DEFAULT_SLICE == 0 && !keepGoing()) break;
+                    route(int(i));
+                }
+            } else if (backend == MAP_BACKEND) {
+                size_t seen = 0;
+                for (auto &p: rbTree) {
+                    if (seen++ % DEFAULT_SLICE == 0 && !keepGoing()) break;
+                    route(p.first);
+                }
+            } else if (backend == SPLAY_BACKEND) {
+                shared_lock<shared_mutex> readLock(splayLock);
+                int last = 0;
+                bool started = false;
+                while (keepGoing() && splayTree.forEachAfter(started ? &last : nullptr, DEFAULT_SLICE, [&](int k, CrimeRecord&){
+                    route(k);
+                    last = k;
+                })) {
+                    started = true;
+                }
+            } else {
+                // routing reads the columns, so this one holds dataLock like the others
+                PersistentTree<int, CrimeRecord>::View version = versionedTree.pin();
+                int last = 0;
+                bool started = false;
+                while (keepGoing() && version.forEachAfter(started ? &last : nullptr, DEFAULT_SLICE, [&](int k, const CrimeRecord&){
+                    route(k);
+                    last = k;
+                })) {
+                    started = true;
+                }
+            }
+        }
+        if (status) {
+            *status = stopped == QUERY_RUNNING ? QUERY_DONE : stopped;
+        }
+        if (stopped != QUERY_RUNNING) {
+            metrics.recordScan(type, backend, 0, 0);
+            return {};
+        }
+
+        uint64_t matched = 0;
+        for (auto &buffer : buffers) matched += buffer.size();
+        metrics.recordScan(type, backend, slots > 0 ? uint64_t(size()) : 0, matched);
+
+        vector<shared_ptr<const vector<int>>> shared(slots);
+        for (int slot = 0; slot < slots; ++slot) {
+            shared[slot] = make_shared<const vector<int>>(move(buffers[slot]));
+        }
+        auto none = make_shared<const vector<int>>();
+        vector<shared_ptr<const vector<int>>> results(queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            results[i] = querySlot[i] >= 0 ? shared[querySlot[i]] : none;
+        }
+        return results;
+    }
+
+    // records in a date and time range, optionally in one area. only the time segments
+    // whose zone maps overlap the range are read, scanned is set to the rows they hold.
+    // the metrics count it as a search of type on the segments
+    vector<int> rangeSearch(const RangeFilter& filter, size_t* scanned = nullptr, int type = RANGE_QUERY) const
+    {
+        TraceSpan span("search.range");
+        size_t read = 0;
+        vector<int> ids;
+        {
+            shared_lock<RwLock> dataRead(dataLock);
+            ids = segments.search(filter, &read);
+        }
+        metrics.recordScan(type, SEGMENT_BACKEND, read, ids.size());
+        if (scanned) *scanned = read;
+        return ids;
+    }
+
+    // records of one year, read from that year's time segments only. a year that isn't a
+    // number matches nothing, as in a scan
+    vector<int> yearSearch(const string& query, size_t* scanned = nullptr) const
+    {
+        int year;
+        if (!parseInt(query, year) || year < 0 || year > 9999) {
+            if (scanned) *scanned = 0;
+            metrics.recordScan(YEAR_QUERY, SEGMENT_BACKEND, 0, 0);
+            return {};
+        }
+        RangeFilter filter;
+        filter.dateLo = year * 10000 + 101;
+        filter.dateHi = year * 10000 + 1231;
+        return rangeSearch(filter, scanned, YEAR_QUERY);
+    }
+
+    // query text in the form used for comparisons, so equivalent queries share a cache entry
+    static string normalizedQuery(int type, const string& query)
+    {
+        int value;
+        if (type == AREA_QUERY) {
+            return areaKey(query);
+        } else if (type == STREET_QUERY) {
+            return streetKey(query);
+        } else if (parseInt(query, value)) {
+            return to_string(value);
+        }
+        return removeExtraSpace(query);
+    }
+
+    // result cache key for a search
+    static string searchKey(int type, const string& query, int backend)
+    {
+        return to_string(type) + '|' + to_string(backend) + '|' + normalizedQuery(type, query);
+    }
+
+    // search through the result cache. record number lookups are cheaper than the
+    // cache and always go to the backend. a year on the segments reads only that year's
+    // segments, any other search on them finds nothing. hit is set when the result came
+    // from the cache
+    shared_ptr<const vector<int>> cachedSearch(int type, const string& query, int backend, bool* hit = nullptr)
+    {
+        if (hit) *hit = false;
+        if (backend == SEGMENT_BACKEND && type != YEAR_QUERY) {
+            return make_shared<const vector<int>>();
+        }
+        if (type == RECORD_QUERY) {
+            return make_shared<const vector<int>>(search(type, query, backend));
+        }
+        string key = searchKey(type, query, backend);
+        // an append during the search must not leave this result cached as current
+        uint64_t searched = version;
+        shared_ptr<const vector<int>> ids = cache.get(key, searched);
+        metrics.recordCache(bool(ids));
+        if (ids) {
+            if (hit) *hit = true;
+            return ids;
+        }
+        ids = make_shared<const vector<int>>(backend == SEGMENT_BACKEND ? yearSearch(query) : search(type, query, backend));
+        cache.put(key, searched, ids);
+        return ids;
+    }
+
+    // number of matching records, answered from posting list sizes. type 0 counts everything
+    long long count(int type, const string& query) const
+    {
+        shared_lock<RwLock> dataRead(dataLock);
+        return postingCount(type, query);
+    }
+
+    // count for callers already holding dataLock
+    long long postingCount(int type, const string& query) const
+    {
+        const vector<int>* list = nullptr;
+        int value;
+        if (type == 0) {
+            return size();
+        } else if (type == AREA_QUERY) {
+            list = index.area(columns.areaCode(query));
+        } else if (type == STREET_QUERY) {
+            list = index.street(columns.streetCode(query));
+        } else if (type == YEAR_QUERY) {
+            if (parseInt(query, value)) list = index.year(value);
+        } else if (type == RECORD_QUERY) {
+            return (parseInt(query, value) && value >= 0 && value < size()) ? 1 : 0;
+        }
+        return list ? (long long)list->size() : 0;
+    }
+
+    // counts per area, year, month or hour over the records matching a filter.
+    // single filter totals come from posting list sizes, anything without a street
+    // from the count cube, and street slices from a counting scan over the columns
+    vector<CountRow> countBy(int group, const CountFilter& filter) const
+    {
+        TraceSpan span("count");
+        shared_lock<RwLock> dataRead(dataLock);
+        vector<CountRow> rows;
+        bool byArea = !removeExtraSpace(filter.area).empty();
+        bool byStreet = !removeExtraSpace(filter.street).empty();
+        bool byYear = !removeExtraSpace(filter.year).empty();
+        if (group < COUNT_ALL || group > COUNT_BY_MONTH) {
+            return rows;
+        }
+
+        if (group == COUNT_ALL && int(byArea) + int(byStreet) + int(byYear) <= 1) {
+            long long total = byArea ? postingCount(AREA_QUERY, filter.area)
+                            : byStreet ? postingCount(STREET_QUERY, filter.street)
+                            : byYear ? postingCount(YEAR_QUERY, filter.year) : size();
+            rows.push_back({"Total", total});
+            return rows;
+        }
+
+        int area = -1, street = -1, year = -1;
+        if ((byArea && (area = columns.areaCode(filter.area)) < 0)
+            || (byStreet && (street = columns.streetCode(filter.street)) < 0)
+            || (byYear && (!parseInt(filter.year, year) || year < 0))) {
+            if (group == COUNT_ALL) rows.push_back({"Total", 0});
+            return rows;
+        }
+
+        vector<long long> counts;
+        int base = 0;
+        if (!byStreet) {
+            static const int dims[] = {CUBE_NONE, CUBE_NONE, CUBE_AREA, CUBE_YEAR, CUBE_HOUR, CUBE_MONTH};
+            // -1 takes in the records whose year, month or hour is unknown
+            int yearLo = byYear ? year : -1;
+            int yearHi = byYear ? year : cube.firstYear() + cube.yearCount() - 1;
+            counts = cube.rollup(area, yearLo, yearHi, -1, 12, -1, 23, dims[group]);
+            base = group == COUNT_BY_YEAR ? cube.firstYear() : group == COUNT_BY_MONTH ? 1 : 0;
+        } else {
+            size_t groups = group == COUNT_BY_AREA ? columns.areaNames.size()
+                          : group == COUNT_BY_YEAR ? size_t(max(columns.maxYear - columns.minYear + 1, 0))
+                          : group == COUNT_BY_MONTH ? 12 : group == COUNT_BY_HOUR ? 24 : 1;
+            base = group == COUNT_BY_YEAR ? columns.minYear : group == COUNT_BY_MONTH ? 1 : 0;
+            // the last bucket takes everything out of range, which is the unknown values
+            counts.assign(groups + 1, 0);
+            const uint16_t* ac = columns.area.data();
+            const int32_t* sc = columns.street.data();
+            const int16_t* yc = columns.year.data();
+            const int8_t* mc = columns.month.data();
+            const int8_t* hc = columns.hour.data();
+            bool anyArea = !byArea, anyYear = !byYear;
+            auto match = [=](size_t i) {
+                return int(sc[i] == street) & int(anyArea | (ac[i] == area)) & int(anyYear | (yc[i] == year));
+            };
+            size_t n = size_t(columns.size());
+            if (group == COUNT_BY_AREA) {
+                countScan(n, [=](size_t i) { return size_t(ac[i]); }, match, counts);
+            } else if (group == COUNT_BY_YEAR) {
+                countScan(n, [=](size_t i) { return size_t(yc[i] - base); }, match, counts);
+            } else if (group == COUNT_BY_MONTH) {
+                countScan(n, [=](size_t i) { return size_t(mc[i] - 1); }, match, counts);
+            } else if (group == COUNT_BY_HOUR) {
+                countScan(n, [=](size_t i) { return size_t(hc[i]); }, match, counts);
+            } else {
+                countScan(n, [](size_t) { return size_t(0); }, match, counts);
+            }
+            if (group == COUNT_ALL || group == COUNT_BY_AREA) {
+                counts.pop_back();
+            }
+        }
+
+        if (group == COUNT_ALL) {
+            rows.push_back({"Total", counts.empty() ? 0 : counts[0]});
+            return rows;
+        }
+        static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (counts[i] == 0) continue;
+            string label;
+            if (group != COUNT_BY_AREA && i + 1 == counts.size()) {
+                label = "Unknown";
+            } else if (group == COUNT_BY_AREA) {
+                label = columns.areaNames[i];
+            } else if (group == COUNT_BY_YEAR) {
+                label = to_string(base + int(i));
+            } else if (group == COUNT_BY_MONTH) {
+                label = months[i];
+            } else {
+                label = (i < 10 ? "0" : "") + to_string(i) + ":00";
+            }
+            rows.push_back({label, counts[i]});
+        }
+        return rows;
+    }
+
+    // add records after loading, every structure is updated in place. queries wait while
+    // the batch goes in and see all of it or none, results cached before it are dropped.
+    // versioned tree searches don't wait, the batch is one new version they see once it
+    // is committed. a tree that isn't built yet is skipped, its build holds dataLock and
+    // reads the appended rows from the record store. returns the record number of the first one
+    int append(const vector<CrimeRecord>& recs)
+    {
+        TraceSpan span("append");
+        unique_lock<RwLock> writeLock(dataLock);
+        int first = size();
+        bool mapBuilt = treeBuilt(MAP_BACKEND);
+        bool splayBuilt = treeBuilt(SPLAY_BACKEND);
+        bool versionedBuilt = treeBuilt(VERSIONED_BACKEND);
+        for (size_t i = 0; i < recs.size(); ++i) {
+            const CrimeRecord& rec = recs[i];
+            int id = first + int(i);
+            if (mapBuilt) {
+                MemoryScope scope(MEM_MAP);
+                rbTree[id] = rec;
+            }
+            if (splayBuilt) {
+                MemoryScope scope(MEM_SPLAY);
+                unique_lock<shared_mutex> splayWrite(splayLock);
+                splayTree.insert(id, rec);
+            }
+            if (versionedBuilt) {
+                MemoryScope scope(MEM_VERSIONED);
+                versionedTree.insert(id, rec);
+            }
+            {
+                MemoryScope scope(MEM_RECORDS);
+                allRecords.push_back(make_pair(id, rec));
+            }
+            {
+                MemoryScope scope(MEM_COLUMNS);
+                columns.add(rec);
+            }
+            {
+                MemoryScope scope(MEM_INDEX);
+                index.add(id, columns);
+            }
+            {
+                MemoryScope scope(MEM_CUBE);
+                cube.add(columns.area[id], columns.year[id], columns.month[id], columns.hour[id]);
+            }
+            {
+                MemoryScope scope(MEM_TOPK);
+                streetStream.add(columns.area[id], columns.street[id]);
+            }
+            {
+                MemoryScope scope(MEM_SEGMENTS);
+                segments.add(id, getDateKey(rec.date), getTimeOfDay(rec.time), columns.area[id]);
+            }
+        }
+        if (versionedBuilt) {
+            MemoryScope scope(MEM_VERSIONED);
+            versionedTree.commit();
+        }
+        recordCount.store(first + int(recs.size()), memory_order_release);
+        ++version;
+        return first;
+    }
+
+    int append(const CrimeRecord& rec)
+    {
+        return append(vector<CrimeRecord>{rec});
+    }
+
+    // live bytes per component from the tracking allocator, the string heap inside each
+    // record holder, bytes per record for each backend and resident memory after load
+    string memoryReport()
+    {
+        shared_lock<RwLock> dataRead(dataLock);
+        MemoryAccount& account = memoryAccount();
+        string out;
+        char line[160];
+        if (!account.active) {
+            out += "allocation tracking is not enabled in this program\n";
+        } else {
+            out += "component            live bytes      blocks   allocations\n";
+            for (int c = 0; c < MEM_COMPONENTS; ++c) {
+                snprintf(line, sizeof(line), "%-16s %14lld %11lld %13lld\n", memComponentName(c),
+                         account.liveBytes[c].load(), account.liveBlocks[c].load(), account.allocations[c].load());
+                out += line;
+            }
+        }
+
+        // strings too long for the small string buffer, counted by walking each holder
+        size_t recordStrings = 0, mapStrings = 0, splayStrings = 0, versionedStrings = 0;
+        auto heapOf = [](const CrimeRecord& r) {
+            return stringHeapBytes(r.date) + stringHeapBytes(r.time) + stringHeapBytes(r.area)
+                 + stringHeapBytes(r.location);
+        };
+        for (auto &p : allRecords) recordStrings += heapOf(p.second);
+        // a tree still being built is counted once it is ready
+        if (treeBuilt(MAP_BACKEND)) {
+            for (auto &p : rbTree) mapStrings += heapOf(p.second);
+        }
+        if (treeBuilt(SPLAY_BACKEND)) {
+            shared_lock<shared_mutex> readLock(splayLock);
+            splayTree.forEach([&](int, CrimeRecord& r) { splayStrings += heapOf(r); });
+        }
+        if (treeBuilt(VERSIONED_BACKEND)) {
+            versionedTree.pin().forEach([&](int, const CrimeRecord& r) { versionedStrings += heapOf(r); });
+        }
+        snprintf(line, sizeof(line), "string heap: record store %zu, map %zu, splay tree %zu, versioned tree %zu bytes\n",
+                 recordStrings, mapStrings, splayStrings, versionedStrings);
+        out += line;
+
+        double n = max(size(), 1);
+        if (account.active) {
+            snprintf(line, sizeof(line), "bytes per record: map %.1f, splay tree %.1f, versioned tree %.1f, record store %.1f, columns %.1f\n",
+                     account.liveBytes[MEM_MAP] / n, account.liveBytes[MEM_SPLAY] / n, account.liveBytes[MEM_VERSIONED] / n,
+                     account.liveBytes[MEM_RECORDS] / n, account.liveBytes[MEM_COLUMNS] / n);
+            out += line;
+        }
+        versionedTree.reclaim();
+        PersistentTreeStats versions = versionedTree.stats();
+        snprintf(line, sizeof(line), "versioned tree: %llu commits, %llu nodes copied, %zu old versions still pinned\n",
+                 (unsigned long long)versions.commits, (unsigned long long)versions.nodesCopied, versions.retainedVersions);
+        out += line;
+        snprintf(line, sizeof(line), "query cache entries: %zu bytes in %zu results\n", cache.bytesUsed(), cache.size());
+        out += line;
+        string building = treeProgress();
+        if (!building.empty()) {
+            out += "trees: " + building + "\n";
+        }
+
+        long long rss, peak;
+        residentMemory(rss, peak);
+        if (loadPeakRss > 0) {
+            snprintf(line, sizeof(line), "resident: peak during load %lld, after load %lld, now %lld bytes\n",
+                     loadPeakRss, loadedRss, rss);
+            out += line;
+        }
+        return out;
+    }
+
+    // top k streets in every area, exact from the indexes or approximate from the stream
+    vector<vector<StreetCount>> topStreets(int k, bool streaming) const
+    {
+        shared_lock<RwLock> dataRead(dataLock);
+        if (!streaming) {
+            return topStreetsExact(columns, index, k);
+        }
+        vector<vector<StreetCount>> result(columns.areaNames.size());
+        for (size_t a = 0; a < result.size(); ++a) {
+            result[a] = streetStream.top(int(a), k);
+        }
+        return result;
+    }
+};
+
+// the loaded dataset behind an atomic pointer, so a reload can replace it while queries run
+using DatabaseStore = SnapshotStore<CrimeDatabase>;
+using DatabasePin = DatabaseStore::Pin;
+
+#endif //CRIMEDATABASE_H
@@ -0,0 +1,49 @@
+#ifndef CRIMEINDEX_H
+#define CRIMEINDEX_H
+#include <map>
+#include <vector>
+#include "CrimeColumns.h"
+
+using namespace std;
+
+// secondary indexes, posting lists of record numbers in ascending order
+struct CrimeIndex
+{
+    vector<vector<int>> byArea;     // by area code
+    vector<vector<int>> byStreet;   // by street code
+    map<int, vector<int>> byYear;
+
+    // index record id, its column entries must already be added
+    void add(int id, const CrimeColumns& cols)
+    {
+        int a = cols.area[id];
+        if (a >= int(byArea.size())) {
+            byArea.resize(a + 1);
+        }
+        byArea[a].push_back(id);
+
+        int s = cols.street[id];
+        if (s >= int(byStreet.size())) {
+            byStreet.resize(s + 1);
+        }
+        byStreet[s].push_back(id);
+
+        byYear[cols.year[id]].push_back(id);
+    }
+
+    // posting list for a code, nullptr if there is none
+    const vector<int>* area(int code) const {
+        return (code >= 0 && code < int(byArea.size())) ? &byArea[code] : nullptr;
+    }
+
+    const vector<int>* street(int code) const {
+        return (code >= 0 && code < int(byStreet.size())) ? &byStreet[code] : nullptr;
+    }
+
+    const vector<int>* year(int y) const {
+        auto it = byYear.find(y);
+        return it == byYear.end() ? nullptr : &it->second;
+    }
+};
+
+#endif //CRIMEINDEX_H
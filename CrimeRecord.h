@@ -0,0 +1,183 @@
+#ifndef CRIMERECORD_H
+#define CRIMERECORD_H
+#include <string>
+#include <cctype>
+
+using namespace std;
+
+struct CrimeRecord
+{
+    string date;
+    string time;
+    string area;
+    string location;
+    int year;
+
+};
+
+// helpers
+inline string removeExtraSpace(string check)
+{
+    string result;
+    bool inSpace = false;
+
+    for (int i = 0; i < check.length(); ++i)
+    {
+        if (isspace(check[i]))
+        {
+            if (!inSpace)
+            {
+                result += ' ';
+                inSpace = true;
+            }
+        }
+        else
+        {
+            result += check[i];
+            inSpace = false;
+        }
+    }
+
+    // Trim leading and trailing space
+    result.erase(0, result.find_first_not_of(' '));
+    result.erase(result.find_last_not_of(' ') + 1);
+
+    return result;
+}
+
+// convert to upper case for string comparison
+inline string toUpper(string check)
+{
+    for (size_t i = 0; i < check.size(); ++i)
+        check[i] = static_cast<char>(toupper(static_cast<unsigned char>(check[i])));
+    return check;
+}
+
+// remove starting numbers of location/space to help with searching for street
+inline string removeLeadingNumber(string check) {
+    size_t i = 0;
+    while (i < check.size() && (isdigit(static_cast<unsigned char>(check[i])) || isspace(static_cast<unsigned char>(check[i])))) {
+        ++i;
+    }
+    return check.substr(i);
+}
+
+// parse a whole number, false if the text is not one
+inline bool parseInt(const string& text, int& out)
+{
+    string s = removeExtraSpace(text);
+    if (s.empty()) {
+        return false;
+    }
+    size_t i = (s[0] == '-') ? 1 : 0;
+    if (i == s.size() || s.size() - i > 9) {
+        return false;
+    }
+    for (size_t j = i; j < s.size(); ++j) {
+        if (!isdigit(static_cast<unsigned char>(s[j]))) {
+            return false;
+        }
+    }
+    out = stoi(s);
+    return true;
+}
+
+// get the month from the date of crime occurance
+inline int getMonth(const string& date)
+{
+    size_t firstSlash = date.find('/');
+    if (firstSlash == string::npos || firstSlash == 0 || firstSlash > 2) {
+        return -1;
+    }
+    int month = 0;
+    for (size_t i = 0; i < firstSlash; ++i) {
+        if (!isdigit(static_cast<unsigned char>(date[i]))) {
+            return -1;
+        }
+        month = month * 10 + (date[i] - '0');
+    }
+    return (month >= 1 && month <= 12) ? month : -1;
+}
+
+// get the hour from the military time of crime occurance (e.g. 2130 -> 21)
+inline int getHour(const string& time)
+{
+    int value = 0;
+    size_t digits = 0;
+    for (char c : time) {
+        if (!isdigit(static_cast<unsigned char>(c))) {
+            return -1;
+        }
+        value = value * 10 + (c - '0');
+        if (++digits > 4) {
+            return -1;
+        }
+    }
+    if (digits == 0 || value / 100 > 23) {
+        return -1;
+    }
+    return value / 100;
+}
+
+// get the date as one sortable number, 10/28/2021 -> 20211028. -1 if it isn't a date
+inline int getDateKey(const string& date)
+{
+    int month = getMonth(date);
+    size_t firstSlash = date.find('/');
+    size_t secondSlash = firstSlash == string::npos ? string::npos : date.find('/', firstSlash + 1);
+    if (month < 0 || secondSlash == string::npos || secondSlash - firstSlash < 2 || secondSlash - firstSlash > 3) {
+        return -1;
+    }
+    int day = 0;
+    for (size_t i = firstSlash + 1; i < secondSlash; ++i) {
+        if (!isdigit(static_cast<unsigned char>(date[i]))) {
+            return -1;
+        }
+        day = day * 10 + (date[i] - '0');
+    }
+    int year = 0;
+    size_t digits = 0;
+    for (size_t i = secondSlash + 1; i < date.size() && isdigit(static_cast<unsigned char>(date[i])); ++i) {
+        year = year * 10 + (date[i] - '0');
+        ++digits;
+    }
+    if (day < 1 || day > 31 || digits != 4) {
+        return -1;
+    }
+    return year * 10000 + month * 100 + day;
+}
+
+// get the year from the date of crime occurance, -1 if the date isn't one. read like the
+// date keys of the time segments, so searches, counts and segments agree on every row
+inline int getYear(const string& date)
+{
+    int key = getDateKey(date);
+    return key < 0 ? -1 : key / 10000;
+}
+
+// get the military time as a number (e.g. "2130" -> 2130), -1 if it isn't one
+inline int getTimeOfDay(const string& time)
+{
+    int hour = getHour(time);
+    if (hour < 0) {
+        return -1;
+    }
+    int value = 0;
+    for (char c : time) {
+        value = value * 10 + (c - '0');
+    }
+    return value % 100 > 59 ? -1 : value;
+}
+
+// normalized keys used by the indexes and searches
+inline string areaKey(const string& area)
+{
+    return toUpper(removeExtraSpace(area));
+}
+
+inline string streetKey(const string& location)
+{
+    return toUpper(removeLeadingNumber(removeExtraSpace(location)));
+}
+
+#endif //CRIMERECORD_H
@@ -0,0 +1,451 @@
+#ifndef DISKSTORE_H
+#define DISKSTORE_H
+#ifdef __linux__
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "CrimeRecord.h"
+#include "Segments.h"
+
+using namespace std;
+
+// out-of-core record store. the csv is converted once into a directory of segment files,
+// each holding the date, time, area and street columns of up to ROWS records followed by
+// the record text. segments are mapped on demand through a buffer pool with a byte
+// budget, so datasets larger than memory can be searched. only the dictionaries and one
+// zone map per segment stay in memory
+
+const uint32_t DISK_MAGIC = 0x4c414754;   // "LAGT"
+const uint32_t DISK_VERSION = 1;
+
+// zone map and size of one segment file, kept in store.meta
+struct DiskZone
+{
+    uint32_t rows;
+    int32_t minDate, maxDate;
+    int16_t minTime, maxTime;
+    uint16_t minArea, maxArea;
+};
+
+// byte offsets of the sections of a segment file with a given row and text size
+struct DiskLayout
+{
+    static const size_t HEADER = 16;
+    size_t dates, times, areas, streets, textOffsets, text, total;
+
+    static size_t align(size_t n) {
+        return (n + 7) & ~size_t(7);
+    }
+
+    DiskLayout(size_t rows, size_t textBytes) {
+        dates = HEADER;
+        times = align(dates + rows * 4);
+        areas = align(times + rows * 2);
+        streets = align(areas + rows * 2);
+        textOffsets = align(streets + rows * 4);
+        text = align(textOffsets + (rows + 1) * 4);
+        total = text + textBytes;
+    }
+};
+
+// a segment file mapped read only, unmapped when the last user lets go
+class MappedSegment {
+private:
+    void* base = MAP_FAILED;
+    size_t length = 0;
+
+public:
+    uint32_t rows = 0;
+    const int32_t* dates = nullptr;
+    const int16_t* times = nullptr;
+    const uint16_t* areas = nullptr;
+    const int32_t* streets = nullptr;
+    const uint32_t* textOffsets = nullptr;
+    const char* text = nullptr;
+
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= off_t(DiskLayout::HEADER)) {
+            length = size_t(st.st_size);
+            base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+        const char* p = static_cast<const char*>(base);
+        uint32_t header[4];
+        memcpy(header, p, sizeof(header));
+        if (header[0] != DISK_MAGIC) {
+            return false;
+        }
+        rows = header[1];
+        DiskLayout layout(rows, header[2]);
+        if (layout.total > length) {
+            return false;
+        }
+        dates = reinterpret_cast<const int32_t*>(p + layout.dates);
+        times = reinterpret_cast<const int16_t*>(p + layout.times);
+        areas = reinterpret_cast<const uint16_t*>(p + layout.areas);
+        streets = reinterpret_cast<const int32_t*>(p + layout.streets);
+        textOffsets = reinterpret_cast<const uint32_t*>(p + layout.textOffsets);
+        text = p + layout.text;
+        return true;
+    }
+
+    ~MappedSegment() {
+        if (base != MAP_FAILED) {
+            munmap(base, length);
+        }
+    }
+
+    size_t bytes() const {
+        return length;
+    }
+
+    // kernel hint for the columns: read ahead for a scan, or fetch pages one by one
+    void adviseColumns(bool sequential) const {
+        if (base == MAP_FAILED) return;
+        size_t columns = size_t(reinterpret_cast<const char*>(textOffsets) - static_cast<const char*>(base));
+        madvise(base, columns, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+
+    // date, time and location of row i, separated by '\0' in the file
+    void fields(uint32_t i, string& date, string& time, string& location) const {
+        const char* p = text + textOffsets[i];
+        date = p;
+        p += date.size() + 1;
+        time = p;
+        p += time.size() + 1;
+        location = p;
+    }
+};
+
+// least recently used mapped segments within a byte budget. a segment still in use by
+// a query stays mapped after eviction until that query drops it
+class SegmentPool {
+private:
+    string dir;
+    size_t budget;
+    size_t used = 0;
+    mutex lock;
+    list<uint32_t> lru;
+    struct Slot {
+        shared_ptr<MappedSegment> segment;
+        list<uint32_t>::iterator pos;
+    };
+    unordered_map<uint32_t, Slot> mapped;
+
+public:
+    long long maps = 0;
+    long long hits = 0;
+    long long evictions = 0;
+    size_t peak = 0;
+
+    SegmentPool(const string& directory, size_t budgetBytes) : dir(directory), budget(budgetBytes) {}
+
+    static string fileName(const string& directory, uint32_t segment) {
+        char name[32];
+        snprintf(name, sizeof(name), "/seg-%06u.col", segment);
+        return directory + name;
+    }
+
+    shared_ptr<MappedSegment> get(uint32_t segment) {
+        lock_guard<mutex> guard(lock);
+        auto it = mapped.find(segment);
+        if (it != mapped.end()) {
+            ++hits;
+            lru.splice(lru.begin(), lru, it->second.pos);
+            return it->second.segment;
+        }
+        auto seg = make_shared<MappedSegment>();
+        if (!seg->open(fileName(dir, segment))) {
+            return nullptr;
+        }
+        ++maps;
+        used += seg->bytes();
+        lru.push_front(segment);
+        mapped[segment] = {seg, lru.begin()};
+        while (used > budget && lru.size() > 1) {
+            uint32_t victim = lru.back();
+            lru.pop_back();
+            used -= mapped[victim].segment->bytes();
+            mapped.erase(victim);
+            ++evictions;
+        }
+        peak = max(peak, used);
+        return seg;
+    }
+
+    size_t bytesMapped() {
+        lock_guard<mutex> guard(lock);
+        return used;
+    }
+};
+
+class DiskStore {
+private:
+    string dir;
+    vector<DiskZone> zones;
+    // segment s holds record numbers [s * ROWS, s * ROWS + zones[s].rows)
+    vector<string> areaNames;
+    unordered_map<string, int> areaCodes;
+    vector<string> streetNames;
+    unordered_map<string, int> streetCodes;
+    long long rows = 0;
+    unique_ptr<SegmentPool> pool;
+
+    static int encode(const string& key, const string& name, unordered_map<string, int>& codes, vector<string>& names) {
+        auto it = codes.find(key);
+        if (it != codes.end()) return it->second;
+        int code = int(names.size());
+        codes.emplace(key, code);
+        names.push_back(name);
+        return code;
+    }
+
+    static void writeString(ofstream& out, const string& s) {
+        uint32_t n = uint32_t(s.size());
+        out.write(reinterpret_cast<const char*>(&n), 4);
+        out.write(s.data(), n);
+    }
+
+    static bool readString(ifstream& in, string& s) {
+        uint32_t n;
+        if (!in.read(reinterpret_cast<char*>(&n), 4)) return false;
+        s.resize(n);
+        return bool(in.read(&s[0], n));
+    }
+
+    // rows collected for the segment being written
+    struct Builder {
+        vector<int32_t> dates;
+        vector<int16_t> times;
+        vector<uint16_t> areas;
+        vector<int32_t> streets;
+        vector<uint32_t> textOffsets;
+        string text;
+        DiskZone zone;
+
+        void clear() {
+            dates.clear();
+            times.clear();
+            areas.clear();
+            streets.clear();
+            textOffsets.clear();
+            text.clear();
+            zone = {0, INT32_MAX, INT32_MIN, INT16_MAX, INT16_MIN, UINT16_MAX, 0};
+        }
+    };
+
+    static bool writeSegment(const string& path, Builder& b) {
+        size_t n = b.dates.size();
+        b.textOffsets.push_back(uint32_t(b.text.size()));
+        DiskLayout layout(n, b.text.size());
+        vector<char> file(layout.total, 0);
+        uint32_t header[4] = {DISK_MAGIC, uint32_t(n), uint32_t(b.text.size()), DISK_VERSION};
+        memcpy(file.data(), header, sizeof(header));
+        memcpy(file.data() + layout.dates, b.dates.data(), n * 4);
+        memcpy(file.data() + layout.times, b.times.data(), n * 2);
+        memcpy(file.data() + layout.areas, b.areas.data(), n * 2);
+        memcpy(file.data() + layout.streets, b.streets.data(), n * 4);
+        memcpy(file.data() + layout.textOffsets, b.textOffsets.data(), (n + 1) * 4);
+        memcpy(file.data() + layout.text, b.text.data(), b.text.size());
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(file.data(), streamsize(file.size()));
+        return bool(out);
+    }
+
+public:
+    static const uint32_t ROWS = 1 << 16;
+
+    // convert a csv into segment files under dir. rows are streamed, only one segment
+    // is held in memory at a time
+    static bool build(const string& csvPath, const string& directory) {
+        ifstream file(csvPath);
+        if (!file) {
+            return false;
+        }
+        mkdir(directory.c_str(), 0755);
+        DiskStore store;
+        Builder b;
+        b.clear();
+        string line;
+        getline(file, line);
+        uint32_t segment = 0;
+        while (true) {
+            bool more = bool(getline(file, line));
+            if (more) {
+                stringstream ss(line);
+                string date, time, area, skip, location;
+                getline(ss, date, ',');
+                getline(ss, time, ',');
+                getline(ss, area, ',');
+                for (int i = 0; i < 3; ++i) {
+                    getline(ss, skip, ',');
+                }
+                getline(ss, location, ',');
+                area = removeExtraSpace(area);
+                location = removeExtraSpace(location);
+
+                int d = getDateKey(date), t = getTimeOfDay(time);
+                int a = encode(areaKey(area), area, store.areaCodes, store.areaNames);
+                int s = encode(toUpper(removeLeadingNumber(location)), toUpper(removeLeadingNumber(location)),
+                               store.streetCodes, store.streetNames);
+                b.dates.push_back(d);
+                b.times.push_back(int16_t(t));
+                b.areas.push_back(uint16_t(a));
+                b.streets.push_back(s);
+                b.textOffsets.push_back(uint32_t(b.text.size()));
+                b.text += date;
+                b.text += '\0';
+                b.text += time;
+                b.text += '\0';
+                b.text += location;
+                b.text += '\0';
+                b.zone.rows++;
+                b.zone.minDate = min(b.zone.minDate, int32_t(d));
+                b.zone.maxDate = max(b.zone.maxDate, int32_t(d));
+                b.zone.minTime = min(b.zone.minTime, int16_t(t));
+                b.zone.maxTime = max(b.zone.maxTime, int16_t(t));
+                b.zone.minArea = min(b.zone.minArea, uint16_t(a));
+                b.zone.maxArea = max(b.zone.maxArea, uint16_t(a));
+            }
+            if (b.zone.rows == ROWS || (!more && b.zone.rows > 0)) {
+                if (!writeSegment(SegmentPool::fileName(directory, segment++), b)) {
+                    return false;
+                }
+                store.zones.push_back(b.zone);
+                store.rows += b.zone.rows;
+                b.clear();
+            }
+            if (!more) break;
+        }
+
+        ofstream meta(directory + "/store.meta", ios::binary | ios::trunc);
+        uint32_t head[4] = {DISK_MAGIC, DISK_VERSION, uint32_t(store.zones.size()), 0};
+        meta.write(reinterpret_cast<const char*>(head), sizeof(head));
+        meta.write(reinterpret_cast<const char*>(store.zones.data()), streamsize(store.zones.size() * sizeof(DiskZone)));
+        uint32_t counts[2] = {uint32_t(store.areaNames.size()), uint32_t(store.streetNames.size())};
+        meta.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+        for (auto &name : store.areaNames) writeString(meta, name);
+        for (auto &name : store.streetNames) writeString(meta, name);
+        return bool(meta);
+    }
+
+    // open a converted directory, false if it isn't one
+    bool open(const string& directory, size_t poolBytes) {
+        ifstream meta(directory + "/store.meta", ios::binary);
+        uint32_t head[4];
+        if (!meta.read(reinterpret_cast<char*>(head), sizeof(head)) || head[0] != DISK_MAGIC || head[1] != DISK_VERSION) {
+            return false;
+        }
+        zones.resize(head[2]);
+        uint32_t counts[2];
+        if (!meta.read(reinterpret_cast<char*>(zones.data()), streamsize(zones.size() * sizeof(DiskZone)))
+            || !meta.read(reinterpret_cast<char*>(counts), sizeof(counts))) {
+            return false;
+        }
+        string name;
+        for (uint32_t i = 0; i < counts[0]; ++i) {
+            if (!readString(meta, name)) return false;
+            encode(areaKey(name), name, areaCodes, areaNames);
+        }
+        for (uint32_t i = 0; i < counts[1]; ++i) {
+            if (!readString(meta, name)) return false;
+            encode(name, name, streetCodes, streetNames);
+        }
+        rows = 0;
+        for (auto &z : zones) rows += z.rows;
+        dir = directory;
+        pool = make_unique<SegmentPool>(directory, poolBytes);
+        return true;
+    }
+
+    long long size() const {
+        return rows;
+    }
+
+    SegmentPool& buffers() {
+        return *pool;
+    }
+
+    int areaCode(const string& query) const {
+        auto it = areaCodes.find(areaKey(query));
+        return it == areaCodes.end() ? -1 : it->second;
+    }
+
+    int streetCode(const string& query) const {
+        auto it = streetCodes.find(streetKey(query));
+        return it == streetCodes.end() ? -1 : it->second;
+    }
+
+    // record numbers of rows in an area (street -1) or on a street (area -1) within a
+    // date range, reading only the columns of segments the zone maps allow.
+    // scanned is set to the rows looked at. false if a segment file couldn't be read
+    bool search(const RangeFilter& f, int street, vector<long long>& ids, long long* scanned = nullptr) {
+        ids.clear();
+        long long touched = 0;
+        for (uint32_t s = 0; s < zones.size(); ++s) {
+            const DiskZone& z = zones[s];
+            if (z.rows == 0 || z.maxDate < f.dateLo || z.minDate > f.dateHi || z.maxTime < f.timeLo
+                || z.minTime > f.timeHi || (f.area >= 0 && (f.area < z.minArea || f.area > z.maxArea))) {
+                continue;
+            }
+            shared_ptr<MappedSegment> seg = pool->get(s);
+            if (!seg) {
+                return false;
+            }
+            seg->adviseColumns(true);
+            touched += seg->rows;
+            long long first = (long long)s * ROWS;
+            for (uint32_t i = 0; i < seg->rows; ++i) {
+                bool match = seg->dates[i] >= f.dateLo && seg->dates[i] <= f.dateHi
+                          && seg->times[i] >= f.timeLo && seg->times[i] <= f.timeHi
+                          && (f.area < 0 || seg->areas[i] == f.area)
+                          && (street < 0 || seg->streets[i] == street);
+                if (match) {
+                    ids.push_back(first + i);
+                }
+            }
+        }
+        if (scanned) *scanned = touched;
+        return true;
+    }
+
+    // the record with a record number, false if there is none
+    bool record(long long id, CrimeRecord& rec) {
+        if (id < 0 || id >= rows) {
+            return false;
+        }
+        shared_ptr<MappedSegment> seg = pool->get(uint32_t(id / ROWS));
+        if (!seg || uint32_t(id % ROWS) >= seg->rows) {
+            return false;
+        }
+        seg->adviseColumns(false);
+        uint32_t i = uint32_t(id % ROWS);
+        seg->fields(i, rec.date, rec.time, rec.location);
+        rec.area = areaNames[seg->areas[i]];
+        rec.year = getYear(rec.date);
+        return true;
+    }
+};
+
+#endif //__linux__
+#endif //DISKSTORE_H
@@ -0,0 +1,252 @@
+#ifndef INGEST_H
+#define INGEST_H
+#ifdef __linux__
+#include <string>
+#include <vector>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <cstdint>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "CrimeDatabase.h"
+
+using namespace std;
+
+// appends rows that show up after load while queries keep running. follows append-only
+// csv files from a byte offset and picks up every .csv file dropped into a watched
+// directory, reading each from its start past the header. only complete lines are taken,
+// a line still being written waits for its newline, a row whose date isn't one is
+// skipped and counted in the metrics. rows go in through
+// CrimeDatabase::append a block at a time, so they get the next record numbers and every
+// index at once. runs on its own thread, woken by inotify or at the latest every pollMs.
+// after a reload every source is read again into the new snapshot, from where its load
+// stopped for the loaded file and from the top for the rest
+class CsvIngest {
+private:
+    struct Source
+    {
+        string path;
+        long long offset = 0;
+        bool header = true;
+        // the file the dataset is loaded from, continues at the snapshot's loadedBytes
+        bool loaded = false;
+        // bytes after the last newline, the start of a line not finished yet
+        string partial;
+    };
+
+    // rows per append, queries get the lock in between
+    static const size_t BLOCK = 4096;
+
+    DatabaseStore& store;
+    // snapshot generation the source offsets belong to
+    uint64_t generation = 0;
+    int pollMs;
+    vector<Source> sources;
+    string dropDir;
+    set<string> seen;
+    int notifyFd = -1;
+    int wakeFd = -1;
+    atomic<bool> stopping{false};
+    thread worker;
+
+    static long long wallNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // pick up .csv files new in the drop directory, in name order. names starting with a
+    // dot are left alone so a writer can rename a finished temp file into place
+    void scanDropDir() {
+        if (dropDir.empty()) {
+            return;
+        }
+        vector<string> found;
+        error_code ec;
+        for (auto &entry : filesystem::directory_iterator(dropDir, ec)) {
+            string name = entry.path().filename().string();
+            if (!entry.is_regular_file(ec) || name.empty() || name[0] == '.' || entry.path().extension() != ".csv") {
+                continue;
+            }
+            if (seen.insert(entry.path().string()).second) {
+                found.push_back(entry.path().string());
+            }
+        }
+        sort(found.begin(), found.end());
+        for (auto &path : found) {
+            Source src;
+            src.path = path;
+            sources.push_back(src);
+        }
+    }
+
+    // append the complete lines written to a source since the last read, returns rows added
+    size_t readSource(Source& src, CrimeDatabase& db) {
+        struct stat st;
+        if (stat(src.path.c_str(), &st) != 0) {
+            return 0;
+        }
+        if (st.st_size < src.offset) {
+            // truncated or replaced, read it again from the top
+            src.offset = 0;
+            src.header = true;
+            src.partial.clear();
+        }
+        if (st.st_size == src.offset) {
+            return 0;
+        }
+        // only what was there at stat, so the modification time covers every byte read
+        long long written = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        ifstream file(src.path, ios::binary);
+        file.seekg(src.offset);
+        string bytes(size_t(st.st_size - src.offset), '\0');
+        file.read(&bytes[0], streamsize(bytes.size()));
+        bytes.resize(size_t(file.gcount()));
+        src.offset += (long long)bytes.size();
+
+        string text = move(src.partial);
+        text += bytes;
+        size_t start = 0, end;
+        vector<CrimeRecord> recs;
+        size_t added = 0;
+        auto flush = [&]() {
+            if (recs.empty()) return;
+            db.append(recs);
+            db.metrics.recordIngest(recs.size(), max(wallNs() - written, 0LL));
+            added += recs.size();
+            recs.clear();
+        };
+        while ((end = text.find('\n', start)) != string::npos) {
+            string line = text.substr(start, end - start);
+            start = end + 1;
+            if (src.header) {
+                src.header = false;
+                continue;
+            }
+            if (removeExtraSpace(line).empty()) {
+                continue;
+            }
+            recs.emplace_back();
+            if (!parseCrimeLine(line, recs.back())) {
+                // a row with a malformed date is counted and left out
+                recs.pop_back();
+                db.metrics.recordSkipped(1);
+                continue;
+            }
+            if (recs.size() == BLOCK) {
+                flush();
+            }
+        }
+        flush();
+        src.partial = text.substr(start);
+        return added;
+    }
+
+    void run() {
+        // signals stay with the main thread, the server takes SIGINT through a signalfd
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+        while (!stopping.load()) {
+            pollOnce();
+            pollfd fds[2] = {{wakeFd, POLLIN, 0}, {notifyFd, POLLIN, 0}};
+            poll(fds, notifyFd >= 0 ? 2 : 1, pollMs);
+            // the events only wake the loop, every source is checked anyway
+            char events[4096];
+            while (notifyFd >= 0 && read(notifyFd, events, sizeof(events)) > 0) {
+            }
+        }
+    }
+
+public:
+    explicit CsvIngest(DatabaseStore& data, int intervalMs = 100)
+        : store(data), pollMs(intervalMs) {
+        notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~CsvIngest() {
+        stop();
+        if (notifyFd >= 0) close(notifyFd);
+        if (wakeFd >= 0) close(wakeFd);
+    }
+
+    CsvIngest(const CsvIngest&) = delete;
+    CsvIngest& operator=(const CsvIngest&) = delete;
+
+    // follow an append-only csv. loaded says it is the file the dataset was loaded from,
+    // reading then continues where the load stopped, otherwise it starts at the header
+    void follow(const string& path, bool loaded = false) {
+        Source src;
+        src.path = path;
+        src.loaded = loaded;
+        DatabasePin db = store.pin();
+        src.offset = loaded ? db->loadedBytes : 0;
+        // a loaded file whose header had no newline yet is read from the top. a last row
+        // loaded without its newline is skipped once it is complete, like a header
+        src.header = src.offset == 0 || (loaded && db->loadedPartial);
+        sources.push_back(src);
+        seen.insert(path);
+        if (notifyFd >= 0) {
+            inotify_add_watch(notifyFd, path.c_str(), IN_MODIFY | IN_ATTRIB);
+        }
+    }
+
+    // take every .csv file put into a directory, false if it can't be watched
+    bool watch(const string& dir) {
+        error_code ec;
+        if (!filesystem::is_directory(dir, ec)) {
+            return false;
+        }
+        dropDir = dir;
+        if (notifyFd >= 0) {
+            inotify_add_watch(notifyFd, dir.c_str(), IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE);
+        }
+        return true;
+    }
+
+    // read every source once, returns the rows appended. start() calls this on its thread
+    size_t pollOnce() {
+        DatabasePin db = store.pin();
+        if (generation != 0 && db.generation() != generation) {
+            for (auto &src : sources) {
+                src.offset = src.loaded ? db->loadedBytes : 0;
+                src.header = src.offset == 0 || (src.loaded && db->loadedPartial);
+                src.partial.clear();
+            }
+        }
+        generation = db.generation();
+        scanDropDir();
+        size_t added = 0;
+        for (auto &src : sources) {
+            added += readSource(src, *db);
+        }
+        return added;
+    }
+
+    void start() {
+        if (!worker.joinable()) {
+            worker = thread([this]() { run(); });
+        }
+    }
+
+    void stop() {
+        stopping.store(true);
+        uint64_t one = 1;
+        (void)!::write(wakeFd, &one, sizeof(one));
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+};
+
+#endif //__linux__
+#endif //INGEST_H
@@ -0,0 +1,242 @@
+#ifndef LOADPIPELINE_H
+#define LOADPIPELINE_H
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include "CrimeDatabase.h"
+#include "BoundedRing.h"
+
+using namespace std;
+
+// what each stage of a pipelined load did. busy times are per stage summed over its
+// threads, waits count the times a stage found its output ring full (backpressure) or
+// its input ring empty
+struct LoadStats
+{
+    double seconds = 0;
+    long long blocks = 0;
+    double readSeconds = 0;
+    double parseSeconds = 0;
+    double recordSeconds = 0;
+    double mapSeconds = 0;
+    double finishSeconds = 0;
+    uint64_t readFull = 0;
+    uint64_t parseFull = 0;
+    uint64_t parseEmpty = 0;
+    uint64_t recordEmpty = 0;
+    uint64_t mapFull = 0;
+};
+
+// load like CrimeDatabase::load with the steps overlapped on threads. one reader cuts the
+// file into blocks of lines, parser threads turn blocks into records, and a sequencer puts
+// the blocks back in file order. it fills the record store, columns, posting lists, top-k
+// and time segments itself and hands every block on to a map builder thread. each hand
+// off is a bounded lock-free ring, so a fast stage waits on a slow one instead of queueing
+// the whole file. the splay tree, versioned tree and count cube need every record and are
+// built afterwards, next to each other. the result is the same as a serial load. unless
+// db.treeMode builds the trees at load, the map stage is skipped and the trees are left
+// to the background or their first search like in a serial load
+inline bool pipelinedLoad(CrimeDatabase& db, const string& path, unsigned parsers, LoadStats* stats = nullptr)
+{
+    ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    using Clock = chrono::steady_clock;
+    auto since = [](Clock::time_point t) { return chrono::duration<double>(Clock::now() - t).count(); };
+    auto started = Clock::now();
+    parsers = max(parsers, 1u);
+    bool trees = db.treeMode == TREES_AT_LOAD;
+
+    const size_t BLOCK = 4096;
+    struct LineBlock
+    {
+        long long seq = 0;
+        vector<string> lines;
+    };
+    struct RecordBlock
+    {
+        long long seq = 0;
+        shared_ptr<const vector<CrimeRecord>> recs;
+    };
+    BoundedRing<LineBlock> raw(2 * parsers);
+    BoundedRing<RecordBlock> parsed(2 * parsers);
+    BoundedRing<shared_ptr<const vector<CrimeRecord>>> toMap(8);
+
+    // busy time per stage in nanoseconds, summed over the threads of the stage
+    atomic<long long> readNs{0}, parseNs{0}, recordNs{0}, mapNs{0};
+    atomic<unsigned> parsing{parsers};
+    long long blocks = 0;
+    auto busy = [](atomic<long long>& total, Clock::time_point t) {
+        total.fetch_add(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t).count(), memory_order_relaxed);
+    };
+
+    thread reader([&]() {
+        string line;
+        // loadedBytes counts complete lines only, as in CrimeDatabase::load
+        getline(file, line);
+        db.loadedBytes = file.eof() ? 0 : (long long)line.size() + 1;
+        while (true) {
+            TraceSpan span("pipeline.read");
+            auto t = Clock::now();
+            LineBlock block;
+            block.seq = blocks;
+            block.lines.reserve(BLOCK);
+            while (block.lines.size() < BLOCK && getline(file, line)) {
+                if (file.eof()) {
+                    db.loadedPartial = true;
+                } else {
+                    db.loadedBytes += (long long)line.size() + 1;
+                }
+                block.lines.push_back(move(line));
+            }
+            busy(readNs, t);
+            span.end();
+            if (block.lines.empty()) {
+                break;
+            }
+            ++blocks;
+            raw.push(move(block));
+        }
+        raw.close();
+    });
+
+    vector<thread> parserThreads;
+    for (unsigned p = 0; p < parsers; ++p) {
+        parserThreads.emplace_back([&]() {
+            LineBlock block;
+            while (raw.pop(block)) {
+                TraceSpan span("pipeline.parse");
+                auto t = Clock::now();
+                auto recs = make_shared<vector<CrimeRecord>>(block.lines.size());
+                for (size_t i = 0; i < block.lines.size(); ++i) {
+                    parseCrimeLine(block.lines[i], (*recs)[i]);
+                }
+                busy(parseNs, t);
+                span.end();
+                parsed.push({block.seq, move(recs)});
+            }
+            // the last parser out closes the ring behind it
+            if (parsing.fetch_sub(1) == 1) {
+                parsed.close();
+            }
+        });
+    }
+
+    thread mapBuilder;
+    if (trees) {
+        mapBuilder = thread([&]() {
+            MemoryScope scope(MEM_MAP);
+            shared_ptr<const vector<CrimeRecord>> recs;
+            int id = 0;
+            while (toMap.pop(recs)) {
+                TraceSpan span("pipeline.map");
+                auto t = Clock::now();
+                // keys only grow, so every insert goes at the end
+                for (auto &rec : *recs) {
+                    db.rbTree.emplace_hint(db.rbTree.end(), id++, rec);
+                }
+                busy(mapNs, t);
+            }
+        });
+    }
+
+    // sequencer on this thread. blocks can come out of the parsers in any order and wait
+    // here until the ones before them are in
+    {
+        map<long long, shared_ptr<const vector<CrimeRecord>>> waiting;
+        long long next = 0;
+        int count = 0;
+        RecordBlock block;
+        while (parsed.pop(block)) {
+            waiting[block.seq] = move(block.recs);
+            for (auto it = waiting.begin(); it != waiting.end() && it->first == next; it = waiting.erase(it), ++next) {
+                TraceSpan span("pipeline.records");
+                auto t = Clock::now();
+                const vector<CrimeRecord>& recs = *it->second;
+                if (trees) {
+                    toMap.push(it->second);
+                }
+                for (size_t i = 0; i < recs.size(); ++i) {
+                    {
+                        MemoryScope scope(MEM_RECORDS);
+                        db.allRecords.push_back(make_pair(count, recs[i]));
+                    }
+                    {
+                        MemoryScope scope(MEM_COLUMNS);
+                        db.columns.add(recs[i]);
+                    }
+                    {
+                        MemoryScope scope(MEM_INDEX);
+                        db.index.add(count, db.columns);
+                    }
+                    {
+                        MemoryScope scope(MEM_TOPK);
+                        db.streetStream.add(db.columns.area[count], db.columns.street[count]);
+                    }
+                    {
+                        MemoryScope scope(MEM_SEGMENTS);
+                        db.segments.add(count, getDateKey(recs[i].date), getTimeOfDay(recs[i].time), db.columns.area[count]);
+                    }
+                    ++count;
+                }
+                busy(recordNs, t);
+            }
+        }
+        toMap.close();
+    }
+    reader.join();
+    for (auto &t : parserThreads) {
+        t.join();
+    }
+    if (mapBuilder.joinable()) {
+        mapBuilder.join();
+    }
+
+    // splay tree, versioned tree and count cube only read the record store and columns
+    auto finishStart = Clock::now();
+    vector<thread> treeBuilders;
+    if (trees) {
+        db.treeLoaded(MAP_BACKEND);
+        treeBuilders.emplace_back([&]() { db.buildTree(SPLAY_BACKEND); });
+        treeBuilders.emplace_back([&]() { db.buildTree(VERSIONED_BACKEND); });
+    }
+    {
+        TraceSpan span("load.cubeBuild");
+        MemoryScope scope(MEM_CUBE);
+        db.cube.build(db.columns);
+    }
+    for (auto &t : treeBuilders) {
+        t.join();
+    }
+    double finishSeconds = since(finishStart);
+
+    db.recordCount.store(int(db.allRecords.size()), memory_order_release);
+    residentMemory(db.loadedRss, db.loadPeakRss);
+    if (db.treeMode == TREES_BACKGROUND) {
+        db.startTreeBuilds({MAP_BACKEND, SPLAY_BACKEND, VERSIONED_BACKEND});
+    }
+
+    if (stats) {
+        stats->seconds = since(started);
+        stats->blocks = blocks;
+        stats->readSeconds = readNs / 1e9;
+        stats->parseSeconds = parseNs / 1e9;
+        stats->recordSeconds = recordNs / 1e9;
+        stats->mapSeconds = mapNs / 1e9;
+        stats->finishSeconds = finishSeconds;
+        stats->readFull = raw.fullCount();
+        stats->parseFull = parsed.fullCount();
+        stats->parseEmpty = raw.emptyCount();
+        stats->recordEmpty = parsed.emptyCount();
+        stats->mapFull = toMap.fullCount();
+    }
+    return true;
+}
+
+#endif //LOADPIPELINE_H
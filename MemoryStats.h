@@ -0,0 +1,156 @@
+#ifndef MEMORYSTATS_H
+#define MEMORYSTATS_H
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+#include <fstream>
+
+using namespace std;
+
+// parts of the database memory is charged to. the thread's current component is set with
+// a MemoryScope, allocations made outside any scope go to MEM_OTHER
+enum MemComponent {
+    MEM_OTHER = 0,
+    MEM_RECORDS = 1,
+    MEM_MAP = 2,
+    MEM_SPLAY = 3,
+    MEM_COLUMNS = 4,
+    MEM_INDEX = 5,
+    MEM_CUBE = 6,
+    MEM_TOPK = 7,
+    MEM_SEGMENTS = 8,
+    MEM_VERSIONED = 9,
+    MEM_CACHE = 10,
+    MEM_COMPONENTS = 11
+};
+
+inline const char* memComponentName(int c)
+{
+    static const char* names[] = {"other", "record store", "map", "splay tree", "columns",
+                                  "posting lists", "count cube", "street top-k", "time segments",
+                                  "versioned tree", "query cache"};
+    return names[c];
+}
+
+// live bytes and allocation counts per component, kept by the tracking operator new
+struct MemoryAccount
+{
+    atomic<long long> liveBytes[MEM_COMPONENTS] = {};
+    atomic<long long> liveBlocks[MEM_COMPONENTS] = {};
+    atomic<long long> allocations[MEM_COMPONENTS] = {};
+    // set once the tracking allocator has handled an allocation in this program
+    atomic<bool> active{false};
+};
+
+inline MemoryAccount& memoryAccount()
+{
+    static MemoryAccount account;
+    return account;
+}
+
+inline int& currentMemComponent()
+{
+    thread_local int component = MEM_OTHER;
+    return component;
+}
+
+// charges allocations made on this thread within the scope to a component
+class MemoryScope {
+private:
+    int previous;
+public:
+    explicit MemoryScope(int component) : previous(currentMemComponent()) {
+        currentMemComponent() = component;
+    }
+    ~MemoryScope() {
+        currentMemComponent() = previous;
+    }
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+};
+
+// the tracking allocator. every block carries a 16 byte header with its size and
+// component so a free is charged back to the component that allocated it. a program
+// turns it on by forwarding its global operator new and delete here, see main.cpp
+struct alignas(16) MemoryHeader
+{
+    size_t size;
+    int component;
+};
+
+inline void* trackedAllocate(size_t size)
+{
+    MemoryHeader* h = static_cast<MemoryHeader*>(malloc(sizeof(MemoryHeader) + size));
+    if (!h) {
+        throw bad_alloc();
+    }
+    int c = currentMemComponent();
+    h->size = size;
+    h->component = c;
+    MemoryAccount& account = memoryAccount();
+    account.liveBytes[c].fetch_add((long long)size, memory_order_relaxed);
+    account.liveBlocks[c].fetch_add(1, memory_order_relaxed);
+    account.allocations[c].fetch_add(1, memory_order_relaxed);
+    if (!account.active.load(memory_order_relaxed)) {
+        account.active.store(true, memory_order_relaxed);
+    }
+    return h + 1;
+}
+
+inline void trackedRelease(void* p)
+{
+    if (!p) {
+        return;
+    }
+    MemoryHeader* h = static_cast<MemoryHeader*>(p) - 1;
+    MemoryAccount& account = memoryAccount();
+    account.liveBytes[h->component].fetch_sub((long long)h->size, memory_order_relaxed);
+    account.liveBlocks[h->component].fetch_sub(1, memory_order_relaxed);
+    free(h);
+}
+
+// charge a block the tracking allocator handed out to another component from now on, for
+// memory that changes hands after it was allocated. p must be what operator new returned
+inline void chargeMemory(const void* p, int component)
+{
+    MemoryAccount& account = memoryAccount();
+    if (!p || !account.active.load(memory_order_relaxed)) {
+        return;
+    }
+    MemoryHeader* h = static_cast<MemoryHeader*>(const_cast<void*>(p)) - 1;
+    if (h->component == component) {
+        return;
+    }
+    account.liveBytes[h->component].fetch_sub((long long)h->size, memory_order_relaxed);
+    account.liveBlocks[h->component].fetch_sub(1, memory_order_relaxed);
+    account.liveBytes[component].fetch_add((long long)h->size, memory_order_relaxed);
+    account.liveBlocks[component].fetch_add(1, memory_order_relaxed);
+    h->component = component;
+}
+
+// resident set size and its peak in bytes from /proc, 0 where that isn't available
+inline void residentMemory(long long& current, long long& peak)
+{
+    current = peak = 0;
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        long long kb;
+        if (sscanf(line.c_str(), "VmRSS: %lld kB", &kb) == 1) {
+            current = kb * 1024;
+        } else if (sscanf(line.c_str(), "VmHWM: %lld kB", &kb) == 1) {
+            peak = kb * 1024;
+        }
+    }
+}
+
+// heap bytes behind a string, 0 while it fits in the string object itself
+inline size_t stringHeapBytes(const string& s)
+{
+    return s.capacity() > string().capacity() ? s.capacity() + 1 : 0;
+}
+
+#endif //MEMORYSTATS_H
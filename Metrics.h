@@ -0,0 +1,309 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <bit>
+
+using namespace std;
+
+// latency histogram in the style of HdrHistogram. values below 64 ns get their own
+// bucket, above that every power of two is split into 32 buckets, so a reported value is
+// within about 3% of the real one. recording is a relaxed atomic add, no locking
+class LatencyHistogram {
+public:
+    static const int EXACT = 64;
+    static const int SUB = 32;
+    // up to 2^42 ns, a little over an hour, longer values go in the last bucket
+    static const int TOP_BIT = 42;
+    static const int BUCKETS = EXACT + (TOP_BIT - 5) * SUB;
+
+private:
+    atomic<uint64_t> counts[BUCKETS] = {};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sumNs{0};
+    atomic<uint64_t> maxNs{0};
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < EXACT) {
+            return int(ns);
+        }
+        int bit = bit_width(ns) - 1;
+        if (bit > TOP_BIT) {
+            return BUCKETS - 1;
+        }
+        return EXACT + (bit - 6) * SUB + int((ns >> (bit - 5)) - SUB);
+    }
+
+    // middle of a bucket's range
+    static uint64_t valueOf(int bucket) {
+        if (bucket < EXACT) {
+            return uint64_t(bucket);
+        }
+        int bit = (bucket - EXACT) / SUB + 6;
+        uint64_t width = uint64_t(1) << (bit - 5);
+        uint64_t low = uint64_t(SUB + (bucket - EXACT) % SUB) << (bit - 5);
+        return low + width / 2;
+    }
+
+public:
+    void record(long long ns) {
+        uint64_t v = ns > 0 ? uint64_t(ns) : 0;
+        counts[bucketOf(v)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sumNs.fetch_add(v, memory_order_relaxed);
+        uint64_t seen = maxNs.load(memory_order_relaxed);
+        while (v > seen && !maxNs.compare_exchange_weak(seen, v, memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const {
+        return total.load(memory_order_relaxed);
+    }
+
+    uint64_t sum() const {
+        return sumNs.load(memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return maxNs.load(memory_order_relaxed);
+    }
+
+    // latency at quantile q (0..1), 0 when nothing was recorded. taken while other
+    // threads record, so it can be off by the queries finishing meanwhile
+    uint64_t quantile(double q) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = uint64_t(q * double(n - 1)) + 1, seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += counts[b].load(memory_order_relaxed);
+            if (seen >= rank) {
+                return min(valueOf(b), max());
+            }
+        }
+        return max();
+    }
+};
+
+// what one query type on one backend has done since start
+struct QuerySeries
+{
+    LatencyHistogram latency;
+    atomic<uint64_t> rowsScanned{0};
+    atomic<uint64_t> rowsMatched{0};
+};
+
+// always on query metrics. series are indexed by query type (1-4, 5 for date ranges) and
+// backend (1-3, 4 for the time segments) like the menu. the segments only answer year and
+// range searches and the trees don't answer ranges, so those pairs have no series.
+// everything is updated with relaxed atomics so queries never wait on it
+class QueryMetrics {
+private:
+    QuerySeries series[6][5];
+
+public:
+    static const int TYPES = 5;
+    static const int BACKENDS = 4;
+
+    atomic<uint64_t> bytesFormatted{0};
+    atomic<uint64_t> cacheHits{0};
+    atomic<uint64_t> cacheMisses{0};
+    // rows appended after load, and the time from the newest row of each batch reaching
+    // its file until queries could see it
+    LatencyHistogram ingestLatency;
+    atomic<uint64_t> rowsIngested{0};
+    // rows following left out because their date couldn't be read
+    atomic<uint64_t> rowsSkipped{0};
+
+    QuerySeries* at(int type, int backend) {
+        if (type < 1 || type > TYPES || backend < 1 || backend > BACKENDS) {
+            return nullptr;
+        }
+        if (backend == BACKENDS ? type != 3 && type != TYPES : type == TYPES) {
+            return nullptr;
+        }
+        return &series[type][backend];
+    }
+
+    const QuerySeries* at(int type, int backend) const {
+        return const_cast<QueryMetrics*>(this)->at(type, backend);
+    }
+
+    // one finished search
+    void recordQuery(int type, int backend, long long ns) {
+        if (QuerySeries* s = at(type, backend)) {
+            s->latency.record(ns);
+        }
+    }
+
+    // rows a scan looked at and rows it returned
+    void recordScan(int type, int backend, uint64_t scanned, uint64_t matched) {
+        if (QuerySeries* s = at(type, backend)) {
+            s->rowsScanned.fetch_add(scanned, memory_order_relaxed);
+            s->rowsMatched.fetch_add(matched, memory_order_relaxed);
+        }
+    }
+
+    void recordCache(bool hit) {
+        (hit ? cacheHits : cacheMisses).fetch_add(1, memory_order_relaxed);
+    }
+
+    // one appended batch
+    void recordIngest(uint64_t rows, long long ns) {
+        rowsIngested.fetch_add(rows, memory_order_relaxed);
+        ingestLatency.record(ns);
+    }
+
+    void recordSkipped(uint64_t rows) {
+        rowsSkipped.fetch_add(rows, memory_order_relaxed);
+    }
+
+    static const char* typeName(int type) {
+        static const char* names[] = {"", "area", "street", "year", "record", "range"};
+        return names[type];
+    }
+
+    static const char* backendName(int backend) {
+        static const char* names[] = {"", "map", "splay", "versioned", "segments"};
+        return names[backend];
+    }
+
+    // readable table for the menu and batch mode
+    string text() const {
+        string out = "type    backend      queries   p50 ns      p99 ns      max ns      rows scanned  rows matched\n";
+        char line[160];
+        for (int t = 1; t <= TYPES; ++t) {
+            for (int b = 1; b <= BACKENDS; ++b) {
+                if (!at(t, b)) continue;
+                const QuerySeries& s = *at(t, b);
+                snprintf(line, sizeof(line), "%-7s %-10s %9llu %11llu %11llu %11llu %13llu %13llu\n",
+                         typeName(t), backendName(b), (unsigned long long)s.latency.count(),
+                         (unsigned long long)s.latency.quantile(0.5), (unsigned long long)s.latency.quantile(0.99),
+                         (unsigned long long)s.latency.max(), (unsigned long long)s.rowsScanned.load(),
+                         (unsigned long long)s.rowsMatched.load());
+                out += line;
+            }
+        }
+        out += "cache hits " + to_string(cacheHits.load()) + ", misses " + to_string(cacheMisses.load())
+             + ", bytes formatted " + to_string(bytesFormatted.load()) + "\n";
+        if (ingestLatency.count() > 0) {
+            out += "ingested " + to_string(rowsIngested.load()) + " rows in " + to_string(ingestLatency.count())
+                 + " batches, append to visible p50 " + to_string(ingestLatency.quantile(0.5)) + " ns, p99 "
+                 + to_string(ingestLatency.quantile(0.99)) + " ns, max " + to_string(ingestLatency.max()) + " ns\n";
+        }
+        if (rowsSkipped.load() > 0) {
+            out += "skipped " + to_string(rowsSkipped.load()) + " ingested rows with a malformed date\n";
+        }
+        return out;
+    }
+
+    // prometheus text exposition format, latencies in seconds
+    string prometheus() const {
+        string out;
+        auto labels = [](int t, int b) {
+            return string("type=\"") + typeName(t) + "\",backend=\"" + backendName(b) + "\"";
+        };
+        out += "# HELP lagta_query_latency_seconds Search latency.\n# TYPE lagta_query_latency_seconds summary\n";
+        for (int t = 1; t <= TYPES; ++t) {
+            for (int b = 1; b <= BACKENDS; ++b) {
+                if (!at(t, b)) continue;
+                const LatencyHistogram& h = at(t, b)->latency;
+                for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                    out += "lagta_query_latency_seconds{" + labels(t, b) + ",quantile=\"" + seconds(q) + "\"} "
+                         + seconds(h.quantile(q) / 1e9) + "\n";
+                }
+                out += "lagta_query_latency_seconds_sum{" + labels(t, b) + "} " + seconds(h.sum() / 1e9) + "\n";
+                out += "lagta_query_latency_seconds_count{" + labels(t, b) + "} " + to_string(h.count()) + "\n";
+            }
+        }
+        out += "# HELP lagta_rows_scanned_total Rows visited by searches.\n# TYPE lagta_rows_scanned_total counter\n";
+        for (int t = 1; t <= TYPES; ++t) {
+            for (int b = 1; b <= BACKENDS; ++b) {
+                if (!at(t, b)) continue;
+                out += "lagta_rows_scanned_total{" + labels(t, b) + "} " + to_string(at(t, b)->rowsScanned.load()) + "\n";
+            }
+        }
+        out += "# HELP lagta_rows_matched_total Rows returned by searches.\n# TYPE lagta_rows_matched_total counter\n";
+        for (int t = 1; t <= TYPES; ++t) {
+            for (int b = 1; b <= BACKENDS; ++b) {
+                if (!at(t, b)) continue;
+                out += "lagta_rows_matched_total{" + labels(t, b) + "} " + to_string(at(t, b)->rowsMatched.load()) + "\n";
+            }
+        }
+        out += "# HELP lagta_bytes_formatted_total Bytes of result output formatted.\n"
+               "# TYPE lagta_bytes_formatted_total counter\n"
+               "lagta_bytes_formatted_total " + to_string(bytesFormatted.load()) + "\n";
+        out += "# HELP lagta_cache_hits_total Result cache hits.\n# TYPE lagta_cache_hits_total counter\n"
+               "lagta_cache_hits_total " + to_string(cacheHits.load()) + "\n";
+        out += "# HELP lagta_cache_misses_total Result cache misses.\n# TYPE lagta_cache_misses_total counter\n"
+               "lagta_cache_misses_total " + to_string(cacheMisses.load()) + "\n";
+        out += "# HELP lagta_ingest_latency_seconds Time from a row reaching its file to being searchable.\n"
+               "# TYPE lagta_ingest_latency_seconds summary\n";
+        for (double q : {0.5, 0.9, 0.99, 0.999}) {
+            out += "lagta_ingest_latency_seconds{quantile=\"" + seconds(q) + "\"} "
+                 + seconds(ingestLatency.quantile(q) / 1e9) + "\n";
+        }
+        out += "lagta_ingest_latency_seconds_sum " + seconds(ingestLatency.sum() / 1e9) + "\n";
+        out += "lagta_ingest_latency_seconds_count " + to_string(ingestLatency.count()) + "\n";
+        out += "# HELP lagta_rows_ingested_total Rows appended after load.\n# TYPE lagta_rows_ingested_total counter\n"
+               "lagta_rows_ingested_total " + to_string(rowsIngested.load()) + "\n";
+        out += "# HELP lagta_rows_skipped_total Rows left out of ingestion for a malformed date.\n"
+               "# TYPE lagta_rows_skipped_total counter\n"
+               "lagta_rows_skipped_total " + to_string(rowsSkipped.load()) + "\n";
+        return out;
+    }
+
+    string json() const {
+        string out = "{\n  \"series\": [";
+        for (int t = 1; t <= TYPES; ++t) {
+            for (int b = 1; b <= BACKENDS; ++b) {
+                if (!at(t, b)) continue;
+                const QuerySeries& s = *at(t, b);
+                out += string(out.back() == '[' ? "\n" : ",\n") + "    {\"type\": \"" + typeName(t) + "\", \"backend\": \"" + backendName(b)
+                     + "\", \"queries\": " + to_string(s.latency.count())
+                     + ", \"p50_ns\": " + to_string(s.latency.quantile(0.5))
+                     + ", \"p90_ns\": " + to_string(s.latency.quantile(0.9))
+                     + ", \"p99_ns\": " + to_string(s.latency.quantile(0.99))
+                     + ", \"p999_ns\": " + to_string(s.latency.quantile(0.999))
+                     + ", \"max_ns\": " + to_string(s.latency.max())
+                     + ", \"sum_ns\": " + to_string(s.latency.sum())
+                     + ", \"rows_scanned\": " + to_string(s.rowsScanned.load())
+                     + ", \"rows_matched\": " + to_string(s.rowsMatched.load()) + "}";
+            }
+        }
+        out += "\n  ],\n  \"bytes_formatted\": " + to_string(bytesFormatted.load())
+             + ",\n  \"cache_hits\": " + to_string(cacheHits.load())
+             + ",\n  \"cache_misses\": " + to_string(cacheMisses.load())
+             + ",\n  \"ingest\": {\"rows\": " + to_string(rowsIngested.load())
+             + ", \"skipped\": " + to_string(rowsSkipped.load())
+             + ", \"batches\": " + to_string(ingestLatency.count())
+             + ", \"p50_ns\": " + to_string(ingestLatency.quantile(0.5))
+             + ", \"p99_ns\": " + to_string(ingestLatency.quantile(0.99))
+             + ", \"max_ns\": " + to_string(ingestLatency.max()) + "}\n}\n";
+        return out;
+    }
+
+    // snapshot file, json for a .json name and prometheus text otherwise
+    bool writeSnapshot(const string& path) const {
+        ofstream out(path);
+        if (!out) {
+            return false;
+        }
+        bool asJson = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+        out << (asJson ? json() : prometheus());
+        return bool(out);
+    }
+
+private:
+    static string seconds(double value) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.9g", value);
+        return text;
+    }
+};
+
+#endif //METRICS_H
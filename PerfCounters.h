@@ -0,0 +1,130 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+#include <string>
+#include <cstdint>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+using namespace std;
+
+// hardware counters read around a measured region
+enum PerfEvent {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS = 1,
+    PERF_L1D_MISSES = 2,
+    PERF_LLC_MISSES = 3,
+    PERF_BRANCH_MISSES = 4,
+    PERF_DTLB_MISSES = 5,
+    PERF_EVENTS = 6
+};
+
+inline const char* perfEventName(int e)
+{
+    static const char* names[] = {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses"};
+    return names[e];
+}
+
+// counters for the calling thread opened with perf_event_open. each counter is opened on
+// its own so one the machine or container doesn't allow only drops that counter, and
+// values are scaled up when the kernel had to multiplex them. elsewhere than linux
+// nothing is available
+class PerfCounters {
+private:
+    int fds[PERF_EVENTS];
+    uint64_t value[PERF_EVENTS] = {};
+
+#ifdef __linux__
+    static int open(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t cacheMiss(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+#endif
+
+public:
+    PerfCounters() {
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            fds[e] = -1;
+        }
+#ifdef __linux__
+        fds[PERF_CYCLES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[PERF_INSTRUCTIONS] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[PERF_L1D_MISSES] = open(PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_L1D));
+        fds[PERF_LLC_MISSES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[PERF_BRANCH_MISSES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds[PERF_DTLB_MISSES] = open(PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_DTLB));
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            if (fds[e] >= 0) close(fds[e]);
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available(int e) const {
+        return fds[e] >= 0;
+    }
+
+    // true if at least one counter could be opened
+    bool any() const {
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            if (available(e)) return true;
+        }
+        return false;
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            if (fds[e] < 0) continue;
+            ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            if (fds[e] < 0) continue;
+            ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+            // count, time enabled, time running
+            uint64_t data[3] = {};
+            if (read(fds[e], data, sizeof(data)) != ssize_t(sizeof(data))) {
+                value[e] = 0;
+                continue;
+            }
+            value[e] = data[2] > 0 && data[2] < data[1] ? uint64_t(double(data[0]) * data[1] / data[2]) : data[0];
+        }
+#endif
+    }
+
+    // count from the last start/stop region
+    uint64_t count(int e) const {
+        return value[e];
+    }
+};
+
+#endif //PERFCOUNTERS_H
@@ -0,0 +1,326 @@
+#ifndef PERSISTENTTREE_H
+#define PERSISTENTTREE_H
+#include <memory>
+#include <vector>
+#include <stack>
+#include <atomic>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include "Snapshot.h"
+
+using namespace std;
+
+// what a persistent tree has done since it was made
+struct PersistentTreeStats
+{
+    uint64_t commits = 0;
+    // published nodes copied because a later version changed them
+    uint64_t nodesCopied = 0;
+    uint64_t liveNodes = 0;
+    // superseded versions still pinned by a reader
+    size_t retainedVersions = 0;
+    size_t nodeBytes = 0;
+};
+
+// ordered map with versions. inserts go into a pending version by path copying: a node
+// of a published version is never changed, the insert copies the nodes on its path and
+// the pending version points at the copies. commit() publishes the pending version with
+// a pointer swap. a reader pins one version and walks it for as long as it likes while
+// the writer carries on, with no lock on either side. the nodes a commit copied stay
+// with the version they came from and are freed with it, once no reader has it pinned.
+// balanced as an avl tree. values are shared between versions, only nodes are copied.
+// one writer at a time, any number of readers
+template <typename K, typename V>
+class PersistentTree {
+private:
+    struct Node {
+        K key;
+        shared_ptr<const V> value;
+        Node* left = nullptr;
+        Node* right = nullptr;
+        int height = 1;
+        // pending commit the node was made for, those are changed in place
+        uint64_t stamp = 0;
+    };
+
+    // one published version. replaced is filled in when the next version is published
+    // with the nodes it copied instead of sharing, they are freed when this version is
+    struct Version {
+        Node* root = nullptr;
+        size_t size = 0;
+        vector<Node*> replaced;
+        atomic<uint64_t>* liveNodes = nullptr;
+
+        ~Version() {
+            for (Node* n : replaced) delete n;
+            if (liveNodes) liveNodes->fetch_sub(replaced.size(), memory_order_relaxed);
+        }
+    };
+
+    atomic<uint64_t> liveNodes{0};
+    atomic<uint64_t> commits{0};
+    atomic<uint64_t> copies{0};
+    SnapshotStore<Version> versions{make_unique<Version>()};
+
+    // writer side: the pending version and the published nodes it stopped using
+    Node* working = nullptr;
+    size_t workingSize = 0;
+    uint64_t stamp = 1;
+    vector<Node*> garbage;
+    Version* published;
+    bool dirty = false;
+
+    static int height(const Node* n) {
+        return n ? n->height : 0;
+    }
+
+    static void update(Node* n) {
+        n->height = 1 + max(height(n->left), height(n->right));
+    }
+
+    Node* make(const K& key, shared_ptr<const V> value) {
+        Node* n = new Node;
+        n->key = key;
+        n->value = move(value);
+        n->stamp = stamp;
+        liveNodes.fetch_add(1, memory_order_relaxed);
+        return n;
+    }
+
+    // the node itself if the pending version made it, otherwise a copy for it to change
+    Node* own(Node* n) {
+        if (n->stamp == stamp) {
+            return n;
+        }
+        Node* copy = new Node(*n);
+        copy->stamp = stamp;
+        garbage.push_back(n);
+        liveNodes.fetch_add(1, memory_order_relaxed);
+        copies.fetch_add(1, memory_order_relaxed);
+        return copy;
+    }
+
+    // n is owned, the child moving up is made owned here
+    Node* rotateRight(Node* n) {
+        Node* l = own(n->left);
+        n->left = l->right;
+        l->right = n;
+        update(n);
+        update(l);
+        return l;
+    }
+
+    Node* rotateLeft(Node* n) {
+        Node* r = own(n->right);
+        n->right = r->left;
+        r->left = n;
+        update(n);
+        update(r);
+        return r;
+    }
+
+    Node* rebalance(Node* n) {
+        update(n);
+        int balance = height(n->left) - height(n->right);
+        if (balance > 1) {
+            if (height(n->left->left) < height(n->left->right)) {
+                n->left = rotateLeft(own(n->left));
+            }
+            return rotateRight(n);
+        }
+        if (balance < -1) {
+            if (height(n->right->right) < height(n->right->left)) {
+                n->right = rotateRight(own(n->right));
+            }
+            return rotateLeft(n);
+        }
+        return n;
+    }
+
+    Node* insertAt(Node* n, const K& key, shared_ptr<const V>& value, bool& added) {
+        if (!n) {
+            added = true;
+            return make(key, move(value));
+        }
+        n = own(n);
+        if (key < n->key) {
+            n->left = insertAt(n->left, key, value, added);
+        } else if (n->key < key) {
+            n->right = insertAt(n->right, key, value, added);
+        } else {
+            n->value = move(value);
+            return n;
+        }
+        return rebalance(n);
+    }
+
+    Node* buildAt(const vector<pair<K, V>>& sorted, int low, int high, atomic<long long>* built) {
+        if (low > high) return nullptr;
+        int mid = low + (high - low) / 2;
+        Node* n = make(sorted[mid].first, make_shared<const V>(sorted[mid].second));
+        if (built) built->fetch_add(1, memory_order_relaxed);
+        n->left = buildAt(sorted, low, mid - 1, built);
+        n->right = buildAt(sorted, mid + 1, high, built);
+        update(n);
+        return n;
+    }
+
+public:
+    // read access to one version, the version stays alive while the view does
+    class View {
+    private:
+        typename SnapshotStore<Version>::Pin pin;
+
+    public:
+        View() = default;
+        explicit View(typename SnapshotStore<Version>::Pin p) : pin(move(p)) {}
+
+        size_t size() const {
+            return pin->size;
+        }
+
+        // 1 for the empty tree, one more for every commit
+        uint64_t generation() const {
+            return pin.generation();
+        }
+
+        const V* find(const K& key) const {
+            const Node* n = pin->root;
+            while (n) {
+                if (key < n->key) {
+                    n = n->left;
+                } else if (n->key < key) {
+                    n = n->right;
+                } else {
+                    return n->value.get();
+                }
+            }
+            return nullptr;
+        }
+
+        // inorder traversal of keys after *after (every key if nullptr), stops after limit
+        // visits. returns true if it stopped with keys left over
+        template <typename Func>
+        bool forEachAfter(const K* after, size_t limit, Func f) const {
+            stack<const Node*> stack;
+            const Node* curr = pin->root;
+            if (after) {
+                while (curr) {
+                    if (*after < curr->key) {
+                        stack.push(curr);
+                        curr = curr->left;
+                    } else {
+                        curr = curr->right;
+                    }
+                }
+            }
+            size_t visited = 0;
+            while (!stack.empty() || curr) {
+                while (curr) {
+                    stack.push(curr);
+                    curr = curr->left;
+                }
+                if (visited == limit) {
+                    return true;
+                }
+                curr = stack.top(); stack.pop();
+                f(curr->key, *curr->value);
+                ++visited;
+                curr = curr->right;
+            }
+            return false;
+        }
+
+        template <typename Func>
+        void forEach(Func f) const {
+            forEachAfter(nullptr, SIZE_MAX, f);
+        }
+    };
+
+    PersistentTree() : published(versions.pin().get()) {}
+
+    ~PersistentTree() {
+        commit();
+        // every node the current version reaches, the older versions free their own
+        stack<Node*> stack;
+        if (working) stack.push(working);
+        while (!stack.empty()) {
+            Node* n = stack.top();
+            stack.pop();
+            if (n->left) stack.push(n->left);
+            if (n->right) stack.push(n->right);
+            delete n;
+        }
+    }
+
+    PersistentTree(const PersistentTree&) = delete;
+    PersistentTree& operator=(const PersistentTree&) = delete;
+
+    // add or replace a key in the pending version, readers see it after the next commit
+    void insert(const K& key, const V& value) {
+        shared_ptr<const V> shared = make_shared<const V>(value);
+        bool added = false;
+        working = insertAt(working, key, shared, added);
+        if (added) ++workingSize;
+        dirty = true;
+    }
+
+    // fill an empty tree from keys in ascending order and publish it. built counts the
+    // keys added so far
+    void build(const vector<pair<K, V>>& sorted, atomic<long long>* built = nullptr) {
+        if (working || sorted.empty()) {
+            for (auto &p : sorted) {
+                insert(p.first, p.second);
+                if (built) built->fetch_add(1, memory_order_relaxed);
+            }
+        } else {
+            working = buildAt(sorted, 0, int(sorted.size()) - 1, built);
+            workingSize = sorted.size();
+            dirty = true;
+        }
+        commit();
+    }
+
+    // publish the pending version, returns its generation
+    uint64_t commit() {
+        if (!dirty) {
+            return versions.pin().generation();
+        }
+        auto next = make_unique<Version>();
+        next->root = working;
+        next->size = workingSize;
+        next->liveNodes = &liveNodes;
+        Version* upcoming = next.get();
+        // readers of the published version only read its root and size
+        published->replaced = move(garbage);
+        garbage.clear();
+        uint64_t generation = versions.publish(move(next));
+        published = upcoming;
+        ++stamp;
+        dirty = false;
+        commits.fetch_add(1, memory_order_relaxed);
+        return generation;
+    }
+
+    View pin() {
+        return View(versions.pin());
+    }
+
+    // free versions no reader holds any more, commit does this as well
+    size_t reclaim() {
+        return versions.reclaim();
+    }
+
+    PersistentTreeStats stats() {
+        PersistentTreeStats s;
+        s.commits = commits.load();
+        s.nodesCopied = copies.load();
+        s.liveNodes = liveNodes.load();
+        s.retainedVersions = versions.retired();
+        s.nodeBytes = sizeof(Node);
+        return s;
+    }
+};
+
+#endif //PERSISTENTTREE_H
@@ -0,0 +1,131 @@
+#ifndef QUERYCACHE_H
+#define QUERYCACHE_H
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include "MemoryStats.h"
+
+using namespace std;
+
+// least recently used cache of search results (record number lists), bounded by
+// an approximate byte budget. entries belong to one dataset version, a lookup or put
+// with a newer version empties the cache. one with an older version comes from a
+// search that started before an append, it misses and isn't stored. the entries and the
+// result lists they hold are charged to MEM_CACHE
+class QueryCache {
+private:
+    struct Entry {
+        string key;
+        shared_ptr<const vector<int>> ids;
+        size_t bytes;
+    };
+    size_t budget;
+    size_t used = 0;
+    uint64_t version = 0;
+    // front is the most recently used
+    list<Entry> lru;
+    unordered_map<string, list<Entry>::iterator> entries;
+    long long hitCount = 0;
+    long long missCount = 0;
+    mutable mutex lock;
+
+    static size_t entryBytes(const string& key, const vector<int>& ids) {
+        // list node, hash node and the key are counted with a rough fixed overhead
+        return sizeof(Entry) + 64 + key.size() + ids.size() * sizeof(int);
+    }
+
+    void dropAll() {
+        lru.clear();
+        entries.clear();
+        used = 0;
+    }
+
+    // false for a version older than the entries, a newer one drops them
+    bool current(uint64_t datasetVersion) {
+        if (datasetVersion < version) {
+            return false;
+        }
+        if (datasetVersion > version) {
+            dropAll();
+            version = datasetVersion;
+        }
+        return true;
+    }
+
+public:
+    explicit QueryCache(size_t budgetBytes = 64u << 20) : budget(budgetBytes) {}
+
+    // cached ids for key, nullptr on a miss
+    shared_ptr<const vector<int>> get(const string& key, uint64_t datasetVersion) {
+        lock_guard<mutex> guard(lock);
+        auto it = current(datasetVersion) ? entries.find(key) : entries.end();
+        if (it == entries.end()) {
+            ++missCount;
+            return nullptr;
+        }
+        ++hitCount;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->ids;
+    }
+
+    void put(const string& key, uint64_t datasetVersion, shared_ptr<const vector<int>> ids) {
+        lock_guard<mutex> guard(lock);
+        if (!current(datasetVersion)) {
+            return;
+        }
+        size_t bytes = entryBytes(key, *ids);
+        if (bytes > budget) {
+            return;
+        }
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            used -= it->second->bytes;
+            lru.erase(it->second);
+            entries.erase(it);
+        }
+        // evict from the back until the new entry fits
+        while (used + bytes > budget && !lru.empty()) {
+            used -= lru.back().bytes;
+            entries.erase(lru.back().key);
+            lru.pop_back();
+        }
+        MemoryScope scope(MEM_CACHE);
+        chargeMemory(ids->data(), MEM_CACHE);
+        lru.push_front({key, move(ids), bytes});
+        entries[key] = lru.begin();
+        used += bytes;
+    }
+
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        dropAll();
+    }
+
+    long long hits() const {
+        lock_guard<mutex> guard(lock);
+        return hitCount;
+    }
+    long long misses() const {
+        lock_guard<mutex> guard(lock);
+        return missCount;
+    }
+    double hitRatio() const {
+        lock_guard<mutex> guard(lock);
+        long long total = hitCount + missCount;
+        return total == 0 ? 0.0 : double(hitCount) / double(total);
+    }
+    size_t bytesUsed() const {
+        lock_guard<mutex> guard(lock);
+        return used;
+    }
+    size_t size() const {
+        lock_guard<mutex> guard(lock);
+        return lru.size();
+    }
+};
+
+#endif //QUERYCACHE_H
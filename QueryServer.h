@@ -0,0 +1,432 @@
+#ifndef QUERYSERVER_H
+#define QUERYSERVER_H
+#ifdef __linux__
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "CrimeDatabase.h"
+#include "BatchRunner.h"
+#include "QueryTask.h"
+#include "WorkStealing.h"
+
+using namespace std;
+
+// local query server. one epoll thread accepts connections, reads request lines and
+// writes responses, a work-stealing pool runs the queries. requests use the batch line
+// format and every response is the batch output line, in request order per connection.
+// "STATS" reports served queries and latency percentiles, "METRICS" returns the query
+// metrics in prometheus text format, "RELOAD" (or SIGHUP) reloads the dataset in the
+// background, "SHUTDOWN" stops the server. every query pins the snapshot that was current
+// when it arrived and finishes on it, so a reload never stops or splits a query
+class QueryServer {
+private:
+    struct Connection {
+        int fd;
+        string in;
+        string out;
+        uint64_t nextSeq = 0;
+        uint64_t nextSend = 0;
+        // finished responses waiting for earlier ones
+        map<uint64_t, string> ready;
+        bool wantWrite = false;
+        // client closed its sending side, close once every response is out
+        bool eof = false;
+        // set when the connection goes away, stops its running queries
+        shared_ptr<atomic<bool>> cancelled = make_shared<atomic<bool>>(false);
+    };
+    struct Job {
+        uint64_t conn;
+        uint64_t seq;
+        string line;
+        chrono::steady_clock::time_point received;
+        QueryControl control;
+    };
+    struct Done {
+        uint64_t conn;
+        uint64_t seq;
+        string response;
+    };
+
+    DatabaseStore& data;
+    // starts a background reload and returns the response line, unset when reloads aren't offered
+    function<string()> reload;
+    int workerCount;
+    long long deadlineMs;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    int signalFd = -1;
+    string unixPath;
+    uint64_t nextConnId = 1;
+    unordered_map<uint64_t, Connection> conns;
+
+    unique_ptr<WorkStealingPool> pool;
+
+    mutex doneLock;
+    vector<Done> done;
+    // queue to response latencies of the most recent queries, written under doneLock
+    vector<long long> latencies;
+    long long served = 0;
+    static const size_t MAX_SAMPLES = 1 << 20;
+    // longest request line, a client sending a longer one is dropped
+    static const size_t MAX_LINE = 64 << 10;
+    chrono::steady_clock::time_point started;
+
+    // ids 0-2 are reserved for the listen socket, wake and signal fds
+    enum { LISTEN_ID = 0, WAKE_ID = 1, SIGNAL_ID = 2 };
+
+    static void setNonBlocking(int fd) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    void watch(int fd, uint64_t id, uint32_t events, int op) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = id;
+        epoll_ctl(epollFd, op, fd, &ev);
+    }
+
+    void complete(const Job& job, const string& response) {
+        long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - job.received).count();
+        {
+            lock_guard<mutex> guard(doneLock);
+            done.push_back({job.conn, job.seq, response});
+            if (latencies.size() < MAX_SAMPLES) {
+                latencies.push_back(ns);
+            } else {
+                latencies[size_t(served) % MAX_SAMPLES] = ns;
+            }
+            ++served;
+        }
+        uint64_t one = 1;
+        (void)!::write(wakeFd, &one, sizeof(one));
+    }
+
+    // run a query on the pool a slice at a time. an unfinished query re-queues itself
+    // behind newer work, so lookups don't wait for scans and idle workers steal the scans
+    void runJob(const Job& job) {
+        BatchQuery q;
+        parseBatchLine(job.line, int(job.seq) + 1, q);
+        auto batchJob = make_shared<BatchJob>(data.pin(), q, job.control);
+        auto step = make_shared<function<void()>>();
+        *step = [this, batchJob, job, step]() {
+            if (!batchJob->step()) {
+                pool->yield(*step);
+                return;
+            }
+            complete(job, batchJob->output());
+            // break the self reference
+            *step = nullptr;
+        };
+        (*step)();
+    }
+
+    string stats() {
+        vector<long long> sorted;
+        long long total;
+        {
+            lock_guard<mutex> guard(doneLock);
+            sorted = latencies;
+            total = served;
+        }
+        sort(sorted.begin(), sorted.end());
+        auto pct = [&](double p) {
+            return sorted.empty() ? 0 : sorted[min(sorted.size() - 1, size_t(p * sorted.size()))];
+        };
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        return "served " + to_string(total) + " | p50 " + to_string(pct(0.50)) + " ns | p99 "
+               + to_string(pct(0.99)) + " ns | max " + to_string(sorted.empty() ? 0 : sorted.back())
+               + " ns | " + to_string(seconds > 0 ? (long long)(total / seconds) : 0) + " queries/s\n";
+    }
+
+    void closeConnection(uint64_t id) {
+        auto it = conns.find(id);
+        if (it == conns.end()) return;
+        it->second.cancelled->store(true);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        close(it->second.fd);
+        conns.erase(it);
+    }
+
+    // write as much pending output as the socket takes, then watch for writability if needed
+    void flushConnection(uint64_t id) {
+        auto it = conns.find(id);
+        if (it == conns.end()) return;
+        Connection& c = it->second;
+        while (!c.out.empty()) {
+            ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                c.out.erase(0, size_t(n));
+            } else if (n < 0 && errno == EAGAIN) {
+                break;
+            } else {
+                closeConnection(id);
+                return;
+            }
+        }
+        if (c.eof && c.out.empty() && c.nextSend == c.nextSeq) {
+            closeConnection(id);
+            return;
+        }
+        bool want = !c.out.empty();
+        if (want != c.wantWrite) {
+            c.wantWrite = want;
+            watch(c.fd, id, (c.eof ? 0u : uint32_t(EPOLLIN | EPOLLRDHUP)) | (want ? uint32_t(EPOLLOUT) : 0u), EPOLL_CTL_MOD);
+        }
+    }
+
+    // queue complete lines, false if the client asked to shut down. reads at most about
+    // MAX_LINE at a time, the rest stays in the socket until the lines so far are queued
+    bool readConnection(uint64_t id) {
+        Connection& c = conns[id];
+        char buf[16384];
+        while (true) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, size_t(n));
+                if (c.in.size() >= MAX_LINE) {
+                    break;
+                }
+            } else if (n < 0 && errno == EAGAIN) {
+                break;
+            } else if (n == 0) {
+                if (!c.in.empty() && c.in.back() != '\n') {
+                    c.in += '\n';
+                }
+                c.eof = true;
+                watch(c.fd, id, c.wantWrite ? uint32_t(EPOLLOUT) : 0u, EPOLL_CTL_MOD);
+                break;
+            } else {
+                closeConnection(id);
+                return true;
+            }
+        }
+        size_t start = 0, end;
+        vector<Job> batch;
+        bool keepRunning = true;
+        while ((end = c.in.find('\n', start)) != string::npos) {
+            string line = c.in.substr(start, end - start);
+            start = end + 1;
+            string command = toUpper(removeExtraSpace(line));
+            if (command.empty() || command[0] == '#') {
+                continue;
+            } else if (command == "STATS") {
+                c.ready[c.nextSeq++] = stats();
+            } else if (command == "METRICS") {
+                c.ready[c.nextSeq++] = data.pin()->metrics.prometheus();
+            } else if (command == "RELOAD") {
+                c.ready[c.nextSeq++] = reload ? reload() : "reload is not available\n";
+            } else if (command == "SHUTDOWN") {
+                keepRunning = false;
+            } else {
+                QueryControl control;
+                control.cancelled = c.cancelled;
+                auto now = chrono::steady_clock::now();
+                if (deadlineMs > 0) {
+                    control.deadline = now + chrono::milliseconds(deadlineMs);
+                }
+                batch.push_back({id, c.nextSeq++, move(line), now, control});
+            }
+        }
+        c.in.erase(0, start);
+        if (c.in.size() >= MAX_LINE) {
+            closeConnection(id);
+            return keepRunning;
+        }
+        for (auto &job : batch) {
+            pool->submit([this, job]() { runJob(job); });
+        }
+        sendReady(id);
+        return keepRunning;
+    }
+
+    // move responses that are next in order to the output buffer
+    void sendReady(uint64_t id) {
+        auto it = conns.find(id);
+        if (it == conns.end()) return;
+        Connection& c = it->second;
+        for (auto r = c.ready.begin(); r != c.ready.end() && r->first == c.nextSend; r = c.ready.erase(r)) {
+            c.out += r->second;
+            ++c.nextSend;
+        }
+        flushConnection(id);
+    }
+
+    void collectDone() {
+        uint64_t count;
+        (void)!::read(wakeFd, &count, sizeof(count));
+        vector<Done> finished;
+        {
+            lock_guard<mutex> guard(doneLock);
+            finished.swap(done);
+        }
+        vector<uint64_t> touched;
+        for (auto &d : finished) {
+            auto it = conns.find(d.conn);
+            if (it == conns.end()) continue;
+            it->second.ready[d.seq] = move(d.response);
+            touched.push_back(d.conn);
+        }
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+        for (uint64_t id : touched) {
+            sendReady(id);
+        }
+    }
+
+    bool setup(int fd) {
+        listenFd = fd;
+        setNonBlocking(listenFd);
+        if (listen(listenFd, 512) < 0) {
+            return false;
+        }
+        epollFd = epoll_create1(0);
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+        // SIGINT / SIGTERM / SIGHUP arrive through the event loop, workers inherit the blocked mask
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+        signalFd = signalfd(-1, &mask, SFD_NONBLOCK);
+        watch(listenFd, LISTEN_ID, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakeFd, WAKE_ID, EPOLLIN, EPOLL_CTL_ADD);
+        watch(signalFd, SIGNAL_ID, EPOLLIN, EPOLL_CTL_ADD);
+        nextConnId = 3;
+        return epollFd >= 0 && wakeFd >= 0 && signalFd >= 0;
+    }
+
+public:
+    // searches running longer than deadline ms (0 for none) are stopped and answered "timed out"
+    QueryServer(DatabaseStore& database, int workers, long long deadline = 0)
+        : data(database), workerCount(max(workers, 1)), deadlineMs(deadline) {}
+
+    void onReload(function<string()> startReload) {
+        reload = move(startReload);
+    }
+
+    ~QueryServer() {
+        for (auto &c : conns) close(c.second.fd);
+        if (listenFd >= 0) close(listenFd);
+        if (epollFd >= 0) close(epollFd);
+        if (wakeFd >= 0) close(wakeFd);
+        if (signalFd >= 0) close(signalFd);
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+    }
+
+    bool listenUnix(const string& path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            return false;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return false;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return false;
+        }
+        unixPath = path;
+        return setup(fd);
+    }
+
+    // tcp on 127.0.0.1 only
+    bool listenTcp(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return false;
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return false;
+        }
+        return setup(fd);
+    }
+
+    // serve until SIGINT, SIGTERM or a SHUTDOWN request, then return the final stats line
+    string run() {
+        started = chrono::steady_clock::now();
+        pool = make_unique<WorkStealingPool>(unsigned(workerCount));
+
+        bool running = true;
+        epoll_event events[256];
+        while (running) {
+            int n = epoll_wait(epollFd, events, 256, -1);
+            if (n < 0 && errno == EINTR) continue;
+            for (int i = 0; i < n && running; ++i) {
+                uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) {
+                    int fd;
+                    while ((fd = accept(listenFd, nullptr, nullptr)) >= 0) {
+                        setNonBlocking(fd);
+                        uint64_t cid = nextConnId++;
+                        conns[cid].fd = fd;
+                        watch(fd, cid, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+                    }
+                } else if (id == WAKE_ID) {
+                    collectDone();
+                } else if (id == SIGNAL_ID) {
+                    signalfd_siginfo info;
+                    while (::read(signalFd, &info, sizeof(info)) == ssize_t(sizeof(info))) {
+                        if (info.ssi_signo == SIGHUP && reload) {
+                            cerr << reload();
+                        } else if (info.ssi_signo != SIGHUP) {
+                            running = false;
+                        }
+                    }
+                } else if (conns.count(id)) {
+                    if (events[i].events & EPOLLIN) {
+                        running = readConnection(id);
+                    }
+                    if (conns.count(id) && (events[i].events & EPOLLOUT)) {
+                        flushConnection(id);
+                    }
+                    if (conns.count(id) && (events[i].events & EPOLLERR)) {
+                        closeConnection(id);
+                    }
+                }
+            }
+        }
+
+        // queued queries see the cancel flag and finish right away
+        for (auto &c : conns) {
+            c.second.cancelled->store(true);
+        }
+        pool.reset();
+        return stats();
+    }
+};
+
+#endif //__linux__
+#endif //QUERYSERVER_H
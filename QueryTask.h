@@ -0,0 +1,111 @@
+#ifndef QUERYTASK_H
+#define QUERYTASK_H
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+// records a scan covers between suspensions, small enough for a few hundred microseconds of work
+const size_t DEFAULT_SLICE = 4096;
+
+enum QueryStatus { QUERY_RUNNING = 0, QUERY_DONE = 1, QUERY_CANCELLED = 2, QUERY_TIMED_OUT = 3 };
+
+// lets whoever started a query stop it. cancelled is shared so one flag can stop
+// every query of a client, the deadline belongs to the single query
+struct QueryControl
+{
+    shared_ptr<atomic<bool>> cancelled;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+
+    // QUERY_RUNNING while the query may continue
+    int check() const {
+        if (cancelled && cancelled->load(memory_order_relaxed)) {
+            return QUERY_CANCELLED;
+        }
+        if (deadline != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() > deadline) {
+            return QUERY_TIMED_OUT;
+        }
+        return QUERY_RUNNING;
+    }
+};
+
+// what a search coroutine finishes with
+struct SearchOutcome
+{
+    int status = QUERY_DONE;
+    vector<int> ids;
+};
+
+// coroutine for a search that suspends between slices of its scan, step() runs one slice
+class SearchTask {
+public:
+    struct promise_type {
+        SearchOutcome outcome;
+        exception_ptr error;
+
+        SearchTask get_return_object() {
+            return SearchTask(coroutine_handle<promise_type>::from_promise(*this));
+        }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        // the yielded value is ignored, yielding only marks a slice boundary
+        suspend_always yield_value(int) noexcept { return {}; }
+        void return_value(SearchOutcome result) { outcome = move(result); }
+        void unhandled_exception() { error = current_exception(); }
+    };
+
+    SearchTask() = default;
+    explicit SearchTask(coroutine_handle<promise_type> h) : handle(h) {}
+    SearchTask(SearchTask&& other) noexcept : handle(other.handle) {
+        other.handle = nullptr;
+    }
+    SearchTask& operator=(SearchTask&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = other.handle;
+            other.handle = nullptr;
+        }
+        return *this;
+    }
+    SearchTask(const SearchTask&) = delete;
+    SearchTask& operator=(const SearchTask&) = delete;
+    ~SearchTask() {
+        if (handle) handle.destroy();
+    }
+
+    // run one slice, true once the search has finished
+    bool step() {
+        if (!handle || handle.done()) {
+            return true;
+        }
+        handle.resume();
+        if (handle.promise().error) {
+            rethrow_exception(handle.promise().error);
+        }
+        return handle.done();
+    }
+
+    bool done() const {
+        return !handle || handle.done();
+    }
+
+    SearchOutcome& outcome() {
+        return handle.promise().outcome;
+    }
+
+    // run every remaining slice
+    SearchOutcome& finish() {
+        while (!step()) {
+        }
+        return outcome();
+    }
+
+private:
+    coroutine_handle<promise_type> handle = nullptr;
+};
+
+#endif //QUERYTASK_H
@@ -0,0 +1,109 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include "CrimeDatabase.h"
+#include "LoadPipeline.h"
+
+using namespace std;
+
+// rebuilds the dataset from its csv on a background thread and publishes it as the next
+// snapshot. queries keep running on the current snapshot while the new one loads, and
+// ones already running finish on it after the swap. the old snapshot is freed as soon as
+// the last of them is done
+class DatasetReloader {
+private:
+    DatabaseStore& store;
+    string path;
+    int parsers;
+    thread worker;
+    atomic<bool> running{false};
+    atomic<bool> stopping{false};
+    mutex statusLock;
+    string lastStatus = "no reload yet";
+
+    void setStatus(const string& text) {
+        lock_guard<mutex> guard(statusLock);
+        lastStatus = text;
+    }
+
+    void run() {
+        // signals stay with the main thread, the server takes them through a signalfd
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        using Clock = chrono::steady_clock;
+        auto ms = [](Clock::time_point t) {
+            return to_string(chrono::duration_cast<chrono::milliseconds>(Clock::now() - t).count());
+        };
+        auto started = Clock::now();
+        shared_ptr<QueryMetrics> metrics = store.pin()->metricsOwner;
+        auto next = make_unique<CrimeDatabase>(metrics);
+        bool loaded = parsers > 0 ? pipelinedLoad(*next, path, unsigned(parsers)) : next->load(path);
+        if (!loaded) {
+            setStatus("reload failed, could not read " + path);
+            running = false;
+            return;
+        }
+        int records = next->size();
+        uint64_t generation = store.publish(move(next));
+        string done = "generation " + to_string(generation) + ": " + to_string(records) + " records loaded in "
+                    + ms(started) + " ms";
+        setStatus(done + ", waiting for queries on the previous one");
+
+        // the old snapshot goes once every query pinning it is done
+        auto swapped = Clock::now();
+        while (store.retired() > 0 && !stopping) {
+            store.reclaim();
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        setStatus(done + ", previous one freed " + ms(swapped) + " ms after the swap");
+        running = false;
+    }
+
+public:
+    // parser threads as for the first load, 0 for the serial load
+    DatasetReloader(DatabaseStore& data, const string& csvPath, int loadThreads)
+        : store(data), path(csvPath), parsers(loadThreads) {}
+
+    ~DatasetReloader() {
+        stopping = true;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    DatasetReloader(const DatasetReloader&) = delete;
+    DatasetReloader& operator=(const DatasetReloader&) = delete;
+
+    // start a reload, false if one is still running
+    bool start() {
+        bool expected = false;
+        if (!running.compare_exchange_strong(expected, true)) {
+            return false;
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+        setStatus("reloading " + path);
+        worker = thread([this]() { run(); });
+        return true;
+    }
+
+    bool busy() const {
+        return running;
+    }
+
+    // what the last reload did
+    string status() {
+        lock_guard<mutex> guard(statusLock);
+        return lastStatus;
+    }
+};
+
+#endif //RELOAD_H
@@ -0,0 +1,157 @@
+#ifndef RESULTWRITER_H
+#define RESULTWRITER_H
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <cerrno>
+#include "CrimeRecord.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <poll.h>
+#endif
+
+using namespace std;
+
+// output stage for result rows. rows are formatted into one large reusable buffer and
+// handed to the os with a single write per buffer instead of going through iostreams.
+// after a write fails the rest of the output is dropped and flush returns false
+class ResultWriter {
+private:
+    int fd;
+    vector<char> buf;
+    size_t len = 0;
+    long long formatNs = 0;
+    long long writeNs = 0;
+    long long written = 0;
+    // errno of the first failed write, 0 while every write went through
+    int failure = 0;
+
+    void put(const char* s, size_t n) {
+        if (len + n > buf.size()) {
+            flush();
+            if (n > buf.size()) {
+                buf.resize(n);
+            }
+        }
+        memcpy(buf.data() + len, s, n);
+        len += n;
+    }
+
+    // right aligned in width like setw, longer values are not cut
+    void padded(const string& s, size_t width) {
+        if (s.size() < width) {
+            size_t pad = width - s.size();
+            if (len + pad > buf.size()) {
+                flush();
+            }
+            memset(buf.data() + len, ' ', pad);
+            len += pad;
+        }
+        put(s.data(), s.size());
+    }
+
+public:
+    explicit ResultWriter(int outFd = 1, size_t bufferBytes = 1 << 20) : fd(outFd), buf(bufferBytes) {}
+
+    ~ResultWriter() {
+        flush();
+    }
+
+    // date | time | area | location, same layout the menu always printed
+    void row(const CrimeRecord& r) {
+        padded(r.date, 15);
+        put(" | ", 3);
+        padded(r.time, 6);
+        put(" | ", 3);
+        padded(r.area, 12);
+        put(" | ", 3);
+        padded(r.location, 20);
+        put("\n", 1);
+    }
+
+    void text(const string& s) {
+        put(s.data(), s.size());
+    }
+
+    // write out the buffer. a write interrupted by a signal is retried, one that would
+    // block on a non-blocking fd waits until the fd is writable. false once a write failed
+    bool flush() {
+        auto start = chrono::steady_clock::now();
+        size_t done = 0;
+        while (done < len && failure == 0) {
+#ifdef _WIN32
+            int n = _write(fd, buf.data() + done, unsigned(len - done));
+#else
+            ssize_t n = ::write(fd, buf.data() + done, len - done);
+#endif
+            if (n > 0) {
+                done += size_t(n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+#ifndef _WIN32
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                pollfd p{fd, POLLOUT, 0};
+                poll(&p, 1, -1);
+#endif
+            } else {
+                failure = n < 0 ? errno : EIO;
+            }
+        }
+        written += (long long)done;
+        len = 0;
+        writeNs += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        return failure == 0;
+    }
+
+    // errno of the first write that failed, 0 if none did
+    int error() const {
+        return failure;
+    }
+
+    long long formatTime() const {
+        return formatNs;
+    }
+    long long writeTime() const {
+        return writeNs;
+    }
+    long long bytesWritten() const {
+        return written;
+    }
+    void addFormatTime(long long ns) {
+        formatNs += ns;
+    }
+    void resetTimes() {
+        formatNs = writeNs = 0;
+    }
+};
+
+// one page of results
+struct Page
+{
+    size_t offset = 0;
+    size_t limit = SIZE_MAX;
+};
+
+// write the rows of a page of results, records are only fetched for rows on the page.
+// time spent in full-buffer writes is kept out of the format time. returns how many rows were written
+template<typename Fetch>
+size_t writePage(ResultWriter& out, const vector<int>& ids, const Page& page, Fetch record)
+{
+    auto start = chrono::steady_clock::now();
+    long long writeBefore = out.writeTime();
+    size_t first = min(page.offset, ids.size());
+    size_t last = first + min(page.limit, ids.size() - first);
+    for (size_t i = first; i < last; ++i) {
+        out.row(record(ids[i]));
+    }
+    long long elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    out.addFormatTime(elapsed - (out.writeTime() - writeBefore));
+    return last - first;
+}
+
+#endif //RESULTWRITER_H
@@ -0,0 +1,82 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// shared mutex that lets a waiting writer in first. std::shared_mutex on linux keeps
+// admitting readers while a writer waits, so a steady stream of queries can hold an
+// append off for seconds. here a new reader waits as soon as a writer is queued, the
+// readers already inside finish and the writer goes next. not recursive: a thread that
+// holds it shared must not lock it shared again, a queued writer would block it.
+// works with shared_lock and unique_lock like shared_mutex
+class RwLock {
+private:
+    mutex m;
+    condition_variable readersCanEnter;
+    condition_variable writerCanEnter;
+    int readers = 0;
+    int waitingWriters = 0;
+    bool writing = false;
+
+public:
+    RwLock() = default;
+    RwLock(const RwLock&) = delete;
+    RwLock& operator=(const RwLock&) = delete;
+
+    void lock() {
+        unique_lock<mutex> guard(m);
+        ++waitingWriters;
+        writerCanEnter.wait(guard, [&] { return !writing && readers == 0; });
+        --waitingWriters;
+        writing = true;
+    }
+
+    bool try_lock() {
+        lock_guard<mutex> guard(m);
+        if (writing || readers > 0) {
+            return false;
+        }
+        writing = true;
+        return true;
+    }
+
+    void unlock() {
+        {
+            lock_guard<mutex> guard(m);
+            writing = false;
+        }
+        // the next writer if there is one, the readers it held back otherwise
+        writerCanEnter.notify_one();
+        readersCanEnter.notify_all();
+    }
+
+    void lock_shared() {
+        unique_lock<mutex> guard(m);
+        readersCanEnter.wait(guard, [&] { return !writing && waitingWriters == 0; });
+        ++readers;
+    }
+
+    bool try_lock_shared() {
+        lock_guard<mutex> guard(m);
+        if (writing || waitingWriters > 0) {
+            return false;
+        }
+        ++readers;
+        return true;
+    }
+
+    void unlock_shared() {
+        bool last;
+        {
+            lock_guard<mutex> guard(m);
+            last = --readers == 0;
+        }
+        if (last) {
+            writerCanEnter.notify_one();
+        }
+    }
+};
+
+#endif //RWLOCK_H
@@ -0,0 +1,141 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+// what a range search asks for. dates are yyyymmdd and times hhmm, both bounds included.
+// records without a usable time have time -1, so only the default time range takes them.
+// area -1 matches every area
+struct RangeFilter
+{
+    int dateLo = INT_MIN;
+    int dateHi = INT_MAX;
+    int timeLo = -1;
+    int timeHi = 2359;
+    int area = -1;
+};
+
+// records of one month in date, time and area columns, with the min and max of each
+// column as a zone map. a segment is sealed once full and never changes after that,
+// later records of the month start a new segment
+struct Segment
+{
+    static const size_t ROWS = 1 << 16;
+
+    int year;
+    int month;
+    vector<int> ids;
+    vector<int32_t> dates;
+    vector<int16_t> times;
+    vector<uint16_t> areas;
+    int32_t minDate = INT32_MAX, maxDate = INT32_MIN;
+    int16_t minTime = INT16_MAX, maxTime = INT16_MIN;
+    uint16_t minArea = UINT16_MAX, maxArea = 0;
+
+    Segment(int y, int m) : year(y), month(m) {}
+
+    bool full() const {
+        return ids.size() >= ROWS;
+    }
+
+    void add(int id, int date, int time, int area) {
+        ids.push_back(id);
+        dates.push_back(date);
+        times.push_back(int16_t(time));
+        areas.push_back(uint16_t(area));
+        minDate = min(minDate, int32_t(date));
+        maxDate = max(maxDate, int32_t(date));
+        minTime = min(minTime, int16_t(time));
+        maxTime = max(maxTime, int16_t(time));
+        minArea = min(minArea, uint16_t(area));
+        maxArea = max(maxArea, uint16_t(area));
+    }
+
+    // false when the zone maps show no record here can match
+    bool mayMatch(const RangeFilter& f) const {
+        if (ids.empty() || maxDate < f.dateLo || minDate > f.dateHi) {
+            return false;
+        }
+        if (maxTime < f.timeLo || minTime > f.timeHi) {
+            return false;
+        }
+        return f.area < 0 || (f.area >= minArea && f.area <= maxArea);
+    }
+};
+
+// record numbers partitioned into segments by year and month. records without a usable
+// date are left out, a range or year search can't match them
+class SegmentStore {
+private:
+    vector<Segment> segments;
+    // year * 12 + month - 1 -> segment still taking records
+    map<int, size_t> open;
+    size_t rows = 0;
+
+public:
+    void add(int id, int date, int time, int area) {
+        if (date < 0 || area < 0) {
+            return;
+        }
+        int year = date / 10000, month = date / 100 % 100;
+        int key = year * 12 + month - 1;
+        auto it = open.find(key);
+        if (it == open.end() || segments[it->second].full()) {
+            segments.emplace_back(year, month);
+            open[key] = segments.size() - 1;
+            it = open.find(key);
+        }
+        segments[it->second].add(id, date, time, area);
+        ++rows;
+    }
+
+    // matching record numbers in record number order. segments the zone maps rule out
+    // are skipped, scanned is set to the rows of the segments that had to be looked at
+    vector<int> search(const RangeFilter& f, size_t* scanned = nullptr) const {
+        vector<int> ids;
+        size_t touched = 0;
+        if (f.dateLo > f.dateHi || f.timeLo > f.timeHi) {
+            if (scanned) *scanned = 0;
+            return ids;
+        }
+        for (const Segment& s : segments) {
+            if (!s.mayMatch(f)) {
+                continue;
+            }
+            touched += s.ids.size();
+            // a segment entirely inside the date and time range with one area needs no row checks
+            bool whole = s.minDate >= f.dateLo && s.maxDate <= f.dateHi && s.minTime >= f.timeLo
+                      && s.maxTime <= f.timeHi && (f.area < 0 || (s.minArea == f.area && s.maxArea == f.area));
+            if (whole) {
+                ids.insert(ids.end(), s.ids.begin(), s.ids.end());
+                continue;
+            }
+            for (size_t i = 0; i < s.ids.size(); ++i) {
+                bool match = s.dates[i] >= f.dateLo && s.dates[i] <= f.dateHi
+                          && s.times[i] >= f.timeLo && s.times[i] <= f.timeHi
+                          && (f.area < 0 || s.areas[i] == f.area);
+                if (match) {
+                    ids.push_back(s.ids[i]);
+                }
+            }
+        }
+        sort(ids.begin(), ids.end());
+        if (scanned) *scanned = touched;
+        return ids;
+    }
+
+    size_t size() const {
+        return rows;
+    }
+
+    size_t segmentCount() const {
+        return segments.size();
+    }
+};
+
+#endif //SEGMENTS_H
@@ -0,0 +1,262 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+// epoch based reclamation. a reader claims a slot stamped with the current epoch for as
+// long as it uses shared data, retiring an object stamps it with the epoch it was
+// unlinked in, and the object is freed once every claimed slot is newer. slots belong to
+// readers rather than threads, so a query that yields and resumes on another worker keeps
+// its slot. claiming and releasing a slot is one atomic operation each, readers never lock.
+// slots come in blocks, when every slot is claimed another block is added instead of
+// waiting, the reader holding a slot may be a suspended query that needs a worker to finish
+class EpochDomain {
+public:
+    static const size_t SLOTS = 1024;
+
+private:
+    static const uint64_t IDLE = UINT64_MAX;
+    struct alignas(64) Slot
+    {
+        atomic<uint64_t> epoch{IDLE};
+    };
+    struct Block
+    {
+        Slot slots[SLOTS];
+        atomic<Block*> next{nullptr};
+    };
+    struct Retired
+    {
+        uint64_t epoch;
+        function<void()> release;
+    };
+
+    unique_ptr<Block> head = make_unique<Block>();
+    atomic<uint64_t> global{1};
+    // only the writer side takes this
+    mutex retireLock;
+    vector<Retired> retired;
+
+    bool claim(Slot& slot) {
+        uint64_t expected = IDLE;
+        return slot.epoch.load(memory_order_relaxed) == IDLE
+            && slot.epoch.compare_exchange_strong(expected, global.load());
+    }
+
+    Slot& slotAt(size_t id) {
+        Block* block = head.get();
+        for (size_t b = id / SLOTS; b > 0; --b) {
+            block = block->next.load();
+        }
+        return block->slots[id % SLOTS];
+    }
+
+public:
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    ~EpochDomain() {
+        for (auto &r : retired) r.release();
+        Block* block = head->next.load();
+        while (block) {
+            Block* next = block->next.load();
+            delete block;
+            block = next;
+        }
+    }
+
+    // claim a free slot at the current epoch, adding a block when every slot is taken
+    size_t enter() {
+        thread_local size_t hint = hash<thread::id>()(this_thread::get_id());
+        Block* block = head.get();
+        for (size_t base = 0; ; base += SLOTS) {
+            for (size_t i = 0; i < SLOTS; ++i) {
+                size_t s = (hint + i) % SLOTS;
+                if (claim(block->slots[s])) {
+                    hint = s;
+                    return base + s;
+                }
+            }
+            Block* next = block->next.load();
+            if (!next) {
+                auto fresh = make_unique<Block>();
+                if (block->next.compare_exchange_strong(next, fresh.get())) {
+                    next = fresh.release();
+                }
+            }
+            block = next;
+        }
+    }
+
+    void exit(size_t slot) {
+        slotAt(slot).epoch.store(IDLE, memory_order_release);
+    }
+
+    // slots there are room for, more than SLOTS once readers needed another block
+    size_t capacity() {
+        size_t slots = 0;
+        for (Block* block = head.get(); block; block = block->next.load()) {
+            slots += SLOTS;
+        }
+        return slots;
+    }
+
+    // free an object once no reader that could have seen it is left. call after it was unlinked
+    void retire(function<void()> release) {
+        uint64_t epoch = global.fetch_add(1);
+        lock_guard<mutex> guard(retireLock);
+        retired.push_back({epoch, move(release)});
+    }
+
+    // free what no reader can reach any more, returns how many objects were freed
+    size_t reclaim() {
+        uint64_t oldest = IDLE;
+        for (Block* block = head.get(); block; block = block->next.load()) {
+            for (size_t i = 0; i < SLOTS; ++i) {
+                oldest = min(oldest, block->slots[i].epoch.load());
+            }
+        }
+        vector<Retired> done;
+        {
+            lock_guard<mutex> guard(retireLock);
+            for (size_t i = 0; i < retired.size();) {
+                if (retired[i].epoch < oldest) {
+                    done.push_back(move(retired[i]));
+                    retired[i] = move(retired.back());
+                    retired.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+        }
+        for (auto &r : done) r.release();
+        return done.size();
+    }
+
+    // retired objects still waiting for readers
+    size_t pending() {
+        lock_guard<mutex> guard(retireLock);
+        return retired.size();
+    }
+};
+
+// the current version of some data behind one atomic pointer. a reader pins whatever is
+// current and keeps using that version until it lets go, however many newer ones get
+// published meanwhile. a writer builds the next version off to the side and publishes it
+// with a pointer swap, the old one is freed through the epoch domain
+template<typename T>
+class SnapshotStore {
+private:
+    struct Entry
+    {
+        unique_ptr<T> value;
+        uint64_t generation;
+    };
+
+    atomic<Entry*> current;
+    atomic<uint64_t> generations{1};
+    EpochDomain epochs;
+
+public:
+    // a reader's hold on one version, move only
+    class Pin {
+    private:
+        friend class SnapshotStore;
+        EpochDomain* domain = nullptr;
+        size_t slot = 0;
+        Entry* entry = nullptr;
+
+    public:
+        Pin() = default;
+        Pin(Pin&& other) noexcept : domain(other.domain), slot(other.slot), entry(other.entry) {
+            other.domain = nullptr;
+            other.entry = nullptr;
+        }
+        Pin& operator=(Pin&& other) noexcept {
+            if (this != &other) {
+                release();
+                domain = other.domain;
+                slot = other.slot;
+                entry = other.entry;
+                other.domain = nullptr;
+                other.entry = nullptr;
+            }
+            return *this;
+        }
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+        ~Pin() {
+            release();
+        }
+
+        void release() {
+            if (domain) {
+                domain->exit(slot);
+                domain = nullptr;
+                entry = nullptr;
+            }
+        }
+
+        T* get() const {
+            return entry ? entry->value.get() : nullptr;
+        }
+        T& operator*() const {
+            return *entry->value;
+        }
+        T* operator->() const {
+            return entry->value.get();
+        }
+        // 1 for the first version, one more for every publish
+        uint64_t generation() const {
+            return entry ? entry->generation : 0;
+        }
+    };
+
+    explicit SnapshotStore(unique_ptr<T> first) : current(new Entry{move(first), 1}) {}
+
+    // every pin has to be released by now
+    ~SnapshotStore() {
+        delete current.load();
+    }
+
+    SnapshotStore(const SnapshotStore&) = delete;
+    SnapshotStore& operator=(const SnapshotStore&) = delete;
+
+    Pin pin() {
+        Pin p;
+        p.domain = &epochs;
+        p.slot = epochs.enter();
+        p.entry = current.load();
+        return p;
+    }
+
+    // make next the current version, returns its generation. readers pinned to the old
+    // one finish on it, it is freed by a later reclaim once they are gone
+    uint64_t publish(unique_ptr<T> next) {
+        uint64_t generation = generations.fetch_add(1) + 1;
+        Entry* old = current.exchange(new Entry{move(next), generation});
+        epochs.retire([old]() { delete old; });
+        epochs.reclaim();
+        return generation;
+    }
+
+    size_t reclaim() {
+        return epochs.reclaim();
+    }
+
+    // old versions still pinned by a reader
+    size_t retired() {
+        return epochs.pending();
+    }
+};
+
+#endif //SNAPSHOT_H
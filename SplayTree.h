@@ -2,9 +2,43 @@
 #define SPLAYTREE_H
 #include <iostream>
 #include <stack>
+#include <utility>
 
 using namespace std;
 
+// build with SPLAY_STATS defined to count rotations and access paths inside the tree.
+// without it the counting statements compile to nothing
+#ifdef SPLAY_STATS
+#define SPLAY_COUNT(statement) statement
+#else
+#define SPLAY_COUNT(statement)
+#endif
+
+// counters kept by a tree built with SPLAY_STATS
+struct SplayStats
+{
+    // histograms are clamped, the last bucket holds everything longer
+    static const int BUCKETS = 64;
+    long long finds = 0;
+    long long findHits = 0;
+    long long inserts = 0;
+    // accesses whose key was already at the root, no rotation needed
+    long long rootHits = 0;
+    long long splays = 0;
+    long long rotations = 0;
+    long long rotationsPerSplay[BUCKETS] = {};
+    // nodes visited from the root down to the key (or where it would be) before splaying
+    long long pathLengths[BUCKETS] = {};
+};
+
+// shape of the tree at one moment
+struct SplayShape
+{
+    long long nodes = 0;
+    int height = 0;
+    double averageDepth = 0;
+};
+
 template <typename K, typename V>
 class SplayTree {
 private:
@@ -21,6 +55,36 @@ private:
         }
     };
     Node* root;
+#ifdef SPLAY_STATS
+    SplayStats counters;
+    long long rotationsBefore = 0;
+
+    static void bump(long long* histogram, long long value) {
+        histogram[value < SplayStats::BUCKETS ? value : SplayStats::BUCKETS - 1]++;
+    }
+
+    // length of the search path to key, walked before the splay changes it
+    void recordAccess(K key) {
+        long long length = 0;
+        for (Node* n = root; n; n = key < n->key ? n->left : n->right) {
+            ++length;
+            if (n->key == key) break;
+        }
+        bump(counters.pathLengths, length);
+        if (root && root->key == key) {
+            counters.rootHits++;
+        }
+    }
+
+    void beginSplay() {
+        counters.splays++;
+        rotationsBefore = counters.rotations;
+    }
+
+    void endSplay() {
+        bump(counters.rotationsPerSplay, counters.rotations - rotationsBefore);
+    }
+#endif
 
     // bst insert
     Node* bstInsert(Node* node, K key, V value) {
@@ -36,12 +100,14 @@ private:
     }
 
     Node *rightRotate(Node* x) {
+        SPLAY_COUNT(counters.rotations++);
         Node* y = x->left;
         x->left = y->right;
         y->right = x;
         return y;
     }
     Node *leftRotate(Node* x) {
+        SPLAY_COUNT(counters.rotations++);
         Node* y = x->right;
         x->right = y->left;
         y->left = x;
@@ -95,17 +161,38 @@ public:
         root = nullptr;
     }
 
+    // frees every node with an explicit stack, a tree built by splaying inserts can be too
+    // deep to free recursively
+    ~SplayTree() {
+        stack<Node*> stack;
+        if (root) stack.push(root);
+        while (!stack.empty()) {
+            Node* n = stack.top();
+            stack.pop();
+            if (n->left) stack.push(n->left);
+            if (n->right) stack.push(n->right);
+            delete n;
+        }
+    }
+
+    SplayTree(const SplayTree&) = delete;
+    SplayTree& operator=(const SplayTree&) = delete;
+
     // initial build for balanced tree
     void rawInsert(K key, V value) {
         root = bstInsert(root, key, value);
     }
 
     void insert(K key, V value) {
+        SPLAY_COUNT(counters.inserts++);
         if (root == nullptr) {
             root = new Node(key, value);
             return;
         }
+        SPLAY_COUNT(recordAccess(key));
+        SPLAY_COUNT(beginSplay());
         root = splay(root, key);
+        SPLAY_COUNT(endSplay());
         if (root->key == key) {
             return;
         }
@@ -125,15 +212,20 @@ public:
     // finds key and splays the node to the root
     V* find(K key)
     {
+        SPLAY_COUNT(counters.finds++);
         if (root == nullptr) {
             return nullptr;
         }
+        SPLAY_COUNT(recordAccess(key));
 
         // move accessed node to root
+        SPLAY_COUNT(beginSplay());
         root = splay(root, key);
+        SPLAY_COUNT(endSplay());
 
         // if found, pointer to stored value
         if (root->key == key) {
+            SPLAY_COUNT(counters.findHits++);
             return &root->value;
         } else {
             return nullptr;
@@ -162,6 +254,107 @@ public:
             curr = curr->right;
         }
     }
+
+    // inorder traversal of keys after *after (every key if nullptr), stops after limit
+    // visits. doesn't splay, so a scan can pause and continue from the last key it saw.
+    // returns true if it stopped with keys left over
+    template <typename Func>
+    bool forEachAfter(const K* after, size_t limit, Func f)
+    {
+        stack<Node*> stack;
+        Node* curr = root;
+
+        // seek: keep the path of nodes with keys greater than after
+        if (after) {
+            while (curr) {
+                if (*after < curr->key) {
+                    stack.push(curr);
+                    curr = curr->left;
+                } else {
+                    curr = curr->right;
+                }
+            }
+        }
+
+        size_t visited = 0;
+        while (!stack.empty() || curr)
+        {
+            while (curr)
+            {
+                stack.push(curr);
+                curr = curr->left;
+            }
+            if (visited == limit) {
+                return true;
+            }
+            curr = stack.top(); stack.pop();
+            f(curr->key, curr->value);
+            ++visited;
+            curr = curr->right;
+        }
+        return false;
+    }
+
+    // node count, height and average node depth (root at depth 1), walks the whole tree
+    SplayShape shape() const
+    {
+        SplayShape result;
+        long long depthSum = 0;
+        stack<pair<Node*, int>> stack;
+        if (root) stack.push({root, 1});
+        while (!stack.empty()) {
+            auto [node, depth] = stack.top();
+            stack.pop();
+            result.nodes++;
+            depthSum += depth;
+            result.height = max(result.height, depth);
+            if (node->left) stack.push({node->left, depth + 1});
+            if (node->right) stack.push({node->right, depth + 1});
+        }
+        result.averageDepth = result.nodes ? double(depthSum) / double(result.nodes) : 0;
+        return result;
+    }
+
+#ifdef SPLAY_STATS
+    const SplayStats& stats() const {
+        return counters;
+    }
+
+    void resetStats() {
+        counters = SplayStats();
+    }
+#endif
+
+    // tree shape, and the access counters when built with SPLAY_STATS
+    void printStats(ostream& out) const
+    {
+        SplayShape s = shape();
+        ios::fmtflags flags = out.flags();
+        streamsize precision = out.precision(2);
+        out.setf(ios::fixed, ios::floatfield);
+        out << "nodes " << s.nodes << ", height " << s.height << ", average depth " << s.averageDepth << "\n";
+#ifdef SPLAY_STATS
+        const SplayStats& c = counters;
+        long long accesses = c.finds + c.inserts;
+        out << "finds " << c.finds << " (" << c.findHits << " found), inserts " << c.inserts
+            << ", root hits " << c.rootHits << " (" << (accesses ? 100.0 * c.rootHits / accesses : 0) << "%)\n";
+        out << "splays " << c.splays << ", rotations " << c.rotations << " ("
+            << (c.splays ? double(c.rotations) / c.splays : 0) << " per splay)\n";
+        auto histogram = [&](const char* name, const long long* buckets) {
+            out << name << ":";
+            for (int i = 0; i < SplayStats::BUCKETS; ++i) {
+                if (buckets[i]) out << " " << i << (i == SplayStats::BUCKETS - 1 ? "+" : "") << "=" << buckets[i];
+            }
+            out << "\n";
+        };
+        histogram("path lengths", c.pathLengths);
+        histogram("rotations per splay", c.rotationsPerSplay);
+#else
+        out << "build with SPLAY_STATS for rotation and access path counters\n";
+#endif
+        out.flags(flags);
+        out.precision(precision);
+    }
 };
 
 #endif //SPLAYTREE_H
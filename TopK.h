@@ -0,0 +1,198 @@
+#ifndef TOPK_H
+#define TOPK_H
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <cstdint>
+#include "CrimeColumns.h"
+#include "CrimeIndex.h"
+
+using namespace std;
+
+// one street in a top k list
+struct StreetCount
+{
+    int street;
+    long long count;
+};
+
+inline bool byCountDesc(const StreetCount& a, const StreetCount& b) {
+    return a.count != b.count ? a.count > b.count : a.street < b.street;
+}
+
+// exact top k streets for every area code. each thread takes every n-th area,
+// walks the area's posting list and counts street codes into a dense array
+inline vector<vector<StreetCount>> topStreetsExact(const CrimeColumns& cols, const CrimeIndex& index, int k,
+                                                   unsigned threads = thread::hardware_concurrency())
+{
+    int areas = int(cols.areaNames.size());
+    vector<vector<StreetCount>> result(areas);
+    threads = max(1u, min(threads, unsigned(max(areas, 1))));
+
+    vector<thread> workers;
+    for (unsigned w = 0; w < threads; ++w) {
+        workers.emplace_back([&, w]() {
+            vector<long long> counts(cols.streetNames.size(), 0);
+            vector<int> touched;
+            for (int a = int(w); a < areas; a += int(threads)) {
+                const vector<int>* list = index.area(a);
+                if (!list) continue;
+                for (int id : *list) {
+                    int s = cols.street[id];
+                    if (counts[s]++ == 0) touched.push_back(s);
+                }
+                vector<StreetCount> all;
+                all.reserve(touched.size());
+                for (int s : touched) {
+                    all.push_back({s, counts[s]});
+                    counts[s] = 0;
+                }
+                touched.clear();
+                size_t keep = min(all.size(), size_t(max(k, 0)));
+                partial_sort(all.begin(), all.begin() + keep, all.end(), byCountDesc);
+                all.resize(keep);
+                result[a] = move(all);
+            }
+        });
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    return result;
+}
+
+// count-min sketch, estimates never undercount
+class CountMinSketch {
+private:
+    int width;
+    int depth;
+    vector<uint32_t> table;
+
+    static uint64_t hash(uint64_t key, int row) {
+        uint64_t x = key + 0x9E3779B97F4A7C15ull * uint64_t(row + 1);
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+public:
+    CountMinSketch(int w = 1024, int d = 4) : width(w), depth(d), table(size_t(w) * d, 0) {}
+
+    void add(uint64_t key) {
+        for (int r = 0; r < depth; ++r) {
+            ++table[size_t(r) * width + hash(key, r) % width];
+        }
+    }
+
+    long long estimate(uint64_t key) const {
+        uint32_t best = UINT32_MAX;
+        for (int r = 0; r < depth; ++r) {
+            best = min(best, table[size_t(r) * width + hash(key, r) % width]);
+        }
+        return best;
+    }
+};
+
+// space-saving heavy hitters: keeps a fixed number of counters, a new key replaces the
+// smallest one and inherits its count. any key seen more than n / capacity times is kept
+class SpaceSaving {
+private:
+    struct Entry {
+        int key;
+        long long count;
+    };
+    size_t capacity;
+    // min heap on count, pos maps a key to its heap slot
+    vector<Entry> heap;
+    unordered_map<int, size_t> pos;
+
+    void swapEntries(size_t i, size_t j) {
+        swap(heap[i], heap[j]);
+        pos[heap[i].key] = i;
+        pos[heap[j].key] = j;
+    }
+    void siftDown(size_t i) {
+        while (true) {
+            size_t l = 2 * i + 1, r = l + 1, m = i;
+            if (l < heap.size() && heap[l].count < heap[m].count) m = l;
+            if (r < heap.size() && heap[r].count < heap[m].count) m = r;
+            if (m == i) return;
+            swapEntries(i, m);
+            i = m;
+        }
+    }
+    void siftUp(size_t i) {
+        while (i > 0 && heap[(i - 1) / 2].count > heap[i].count) {
+            swapEntries(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+public:
+    explicit SpaceSaving(size_t cap = 64) : capacity(cap) {}
+
+    void add(int key) {
+        auto it = pos.find(key);
+        if (it != pos.end()) {
+            ++heap[it->second].count;
+            siftDown(it->second);
+        } else if (heap.size() < capacity) {
+            heap.push_back({key, 1});
+            pos[key] = heap.size() - 1;
+            siftUp(heap.size() - 1);
+        } else {
+            pos.erase(heap[0].key);
+            heap[0].key = key;
+            ++heap[0].count;
+            pos[key] = 0;
+            siftDown(0);
+        }
+    }
+
+    vector<StreetCount> top() const {
+        vector<StreetCount> out;
+        for (auto &e : heap) {
+            out.push_back({e.key, e.count});
+        }
+        sort(out.begin(), out.end(), byCountDesc);
+        return out;
+    }
+};
+
+// approximate top streets per area kept up to date as records are appended.
+// candidates come from space-saving, their counts are tightened with the sketch
+// since both only overcount
+class StreamingTopK {
+private:
+    size_t capacity;
+    vector<SpaceSaving> candidates;
+    vector<CountMinSketch> sketches;
+
+public:
+    explicit StreamingTopK(size_t cap = 64) : capacity(cap) {}
+
+    void add(int area, int street) {
+        if (area >= int(candidates.size())) {
+            candidates.resize(area + 1, SpaceSaving(capacity));
+            sketches.resize(area + 1);
+        }
+        candidates[area].add(street);
+        sketches[area].add(uint64_t(street));
+    }
+
+    vector<StreetCount> top(int area, int k) const {
+        if (area < 0 || area >= int(candidates.size())) {
+            return {};
+        }
+        vector<StreetCount> out = candidates[area].top();
+        for (auto &e : out) {
+            e.count = min(e.count, sketches[area].estimate(uint64_t(e.street)));
+        }
+        sort(out.begin(), out.end(), byCountDesc);
+        if (int(out.size()) > k) out.resize(max(k, 0));
+        return out;
+    }
+};
+
+#endif //TOPK_H
@@ -0,0 +1,143 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+
+using namespace std;
+
+// one finished span. name has to be a string literal, only the pointer is kept
+struct TraceEvent
+{
+    const char* name;
+    int64_t startNs;
+    int64_t durationNs;
+};
+
+// spans of one thread. only the owning thread writes, once full the oldest spans are
+// overwritten, so a long run keeps its most recent spans
+struct TraceRing
+{
+    static const size_t CAPACITY = 1 << 16;
+    vector<TraceEvent> events{CAPACITY};
+    atomic<size_t> next{0};
+    int tid = 0;
+
+    void push(const TraceEvent& e) {
+        size_t at = next.load(memory_order_relaxed);
+        events[at % CAPACITY] = e;
+        next.store(at + 1, memory_order_release);
+    }
+};
+
+// process wide trace state. tracing is off until enable(), a span then costs two clock
+// reads and a write into the thread's own ring, no lock
+class Tracer {
+private:
+    atomic<bool> on{false};
+    chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+    // rings outlive their threads so spans of finished pool workers can still be exported
+    mutex lock;
+    vector<unique_ptr<TraceRing>> rings;
+
+    TraceRing* ring() {
+        thread_local TraceRing* mine = nullptr;
+        if (!mine) {
+            lock_guard<mutex> guard(lock);
+            rings.push_back(make_unique<TraceRing>());
+            mine = rings.back().get();
+            mine->tid = int(rings.size());
+        }
+        return mine;
+    }
+
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void enable() {
+        origin = chrono::steady_clock::now();
+        on.store(true, memory_order_release);
+    }
+
+    bool enabled() const {
+        return on.load(memory_order_relaxed);
+    }
+
+    int64_t now() const {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+    }
+
+    void record(const char* name, int64_t startNs, int64_t durationNs) {
+        ring()->push({name, startNs, durationNs});
+    }
+
+    // chrome trace event json, opens in chrome://tracing or ui.perfetto.dev. meant to be
+    // called once the traced work has stopped
+    bool writeChromeTrace(const string& path) {
+        ofstream out(path);
+        if (!out) {
+            return false;
+        }
+        out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+        bool first = true;
+        char line[256];
+        lock_guard<mutex> guard(lock);
+        for (auto &r : rings) {
+            size_t end = r->next.load(memory_order_acquire);
+            size_t begin = end > TraceRing::CAPACITY ? end - TraceRing::CAPACITY : 0;
+            for (size_t i = begin; i < end; ++i) {
+                const TraceEvent& e = r->events[i % TraceRing::CAPACITY];
+                // chrome wants microseconds, the fraction keeps nanoseconds
+                snprintf(line, sizeof(line),
+                         "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                         first ? "" : ",\n", e.name, r->tid, e.startNs / 1e3, e.durationNs / 1e3);
+                out << line;
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+};
+
+// times the enclosing scope as a span when tracing is on
+class TraceSpan {
+private:
+    const char* name;
+    int64_t start = -1;
+
+public:
+    explicit TraceSpan(const char* spanName) : name(spanName) {
+        Tracer& t = Tracer::instance();
+        if (t.enabled()) {
+            start = t.now();
+        }
+    }
+
+    ~TraceSpan() {
+        end();
+    }
+
+    // close the span before the scope ends
+    void end() {
+        if (start >= 0) {
+            Tracer& t = Tracer::instance();
+            t.record(name, start, t.now() - start);
+            start = -1;
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+#endif //TRACE_H
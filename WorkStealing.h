@@ -0,0 +1,275 @@
+#ifndef WORKSTEALING_H
+#define WORKSTEALING_H
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+using namespace std;
+
+// task pool where every worker has its own deque. a worker takes new tasks from the back
+// of its own deque and steals from the front of the others when it runs dry, so morsels
+// of a big scan spread over every idle worker. tasks submitted from inside a task go to
+// the submitting worker's deque
+class WorkStealingPool {
+private:
+    struct Worker {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<bool> stopping{false};
+    // tasks sitting in deques, and tasks submitted but not finished
+    atomic<long long> queued{0};
+    atomic<long long> unfinished{0};
+    atomic<long long> stolen{0};
+    atomic<unsigned> nextWorker{0};
+    mutex sleepLock;
+    condition_variable wake;
+    condition_variable idle;
+
+    inline static thread_local WorkStealingPool* currentPool = nullptr;
+    inline static thread_local int currentIndex = -1;
+
+    int self() const {
+        return currentPool == this ? currentIndex : -1;
+    }
+
+    void push(function<void()> task, bool front) {
+        int me = self();
+        int target = me >= 0 ? me : int(nextWorker++ % workers.size());
+        unfinished++;
+        {
+            lock_guard<mutex> guard(workers[target]->lock);
+            if (front) {
+                workers[target]->tasks.push_front(move(task));
+            } else {
+                workers[target]->tasks.push_back(move(task));
+            }
+        }
+        queued++;
+        wake.notify_one();
+    }
+
+    // run one task: own deque first (newest), then steal the oldest from another worker
+    bool runOne(int me) {
+        function<void()> task;
+        if (me >= 0) {
+            lock_guard<mutex> guard(workers[me]->lock);
+            if (!workers[me]->tasks.empty()) {
+                task = move(workers[me]->tasks.back());
+                workers[me]->tasks.pop_back();
+            }
+        }
+        if (!task) {
+            size_t n = workers.size();
+            size_t startAt = me >= 0 ? size_t(me) + 1 : size_t(nextWorker.load());
+            for (size_t k = 0; k < n && !task; ++k) {
+                size_t victim = (startAt + k) % n;
+                if (int(victim) == me) continue;
+                lock_guard<mutex> guard(workers[victim]->lock);
+                if (!workers[victim]->tasks.empty()) {
+                    task = move(workers[victim]->tasks.front());
+                    workers[victim]->tasks.pop_front();
+                    if (me >= 0) stolen++;
+                }
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        queued--;
+        task();
+        if (--unfinished == 0) {
+            lock_guard<mutex> guard(sleepLock);
+            idle.notify_all();
+        }
+        return true;
+    }
+
+    void workerLoop(int me) {
+        currentPool = this;
+        currentIndex = me;
+        while (true) {
+            if (runOne(me)) continue;
+            unique_lock<mutex> guard(sleepLock);
+            if (stopping && unfinished == 0) return;
+            wake.wait_for(guard, chrono::milliseconds(5), [&]() { return queued > 0 || (stopping && unfinished == 0); });
+        }
+    }
+
+public:
+    explicit WorkStealingPool(unsigned threadCount = thread::hardware_concurrency()) {
+        threadCount = max(threadCount, 1u);
+        for (unsigned i = 0; i < threadCount; ++i) {
+            workers.push_back(make_unique<Worker>());
+        }
+        for (unsigned i = 0; i < threadCount; ++i) {
+            threads.emplace_back([this, i]() { workerLoop(int(i)); });
+        }
+    }
+
+    // runs every task still queued, then joins the workers
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    // new work, the submitting worker runs it next
+    void submit(function<void()> task) {
+        push(move(task), false);
+    }
+
+    // continuation of a task that paused, goes behind newer work and is the first to be stolen
+    void yield(function<void()> task) {
+        push(move(task), true);
+    }
+
+    // body(lo, hi) over [0, n) in morsels of the given size. the caller runs queued tasks
+    // while it waits, so this can be called from inside a task
+    void parallelFor(size_t n, size_t morsel, const function<void(size_t, size_t)>& body) {
+        if (n == 0) return;
+        morsel = max<size_t>(morsel, 1);
+        auto remaining = make_shared<atomic<size_t>>((n + morsel - 1) / morsel);
+        for (size_t lo = 0; lo < n; lo += morsel) {
+            size_t hi = min(n, lo + morsel);
+            submit([&body, remaining, lo, hi]() {
+                body(lo, hi);
+                (*remaining)--;
+            });
+        }
+        int me = self();
+        while (*remaining > 0) {
+            if (!runOne(me)) {
+                this_thread::yield();
+            }
+        }
+    }
+
+    // wait until every submitted task has finished
+    void waitIdle() {
+        unique_lock<mutex> guard(sleepLock);
+        idle.wait(guard, [&]() { return unfinished == 0; });
+    }
+
+    unsigned size() const {
+        return unsigned(workers.size());
+    }
+
+    long long steals() const {
+        return stolen;
+    }
+};
+
+// one deque and one lock shared by every worker, kept to compare the work-stealing pool against
+class SharedQueuePool {
+private:
+    mutex lock;
+    condition_variable wake;
+    condition_variable idle;
+    deque<function<void()>> tasks;
+    vector<thread> threads;
+    bool stopping = false;
+    long long unfinished = 0;
+
+    bool runOne(unique_lock<mutex>& guard) {
+        if (tasks.empty()) return false;
+        function<void()> task = move(tasks.front());
+        tasks.pop_front();
+        guard.unlock();
+        task();
+        guard.lock();
+        if (--unfinished == 0) {
+            idle.notify_all();
+            wake.notify_all();
+        }
+        return true;
+    }
+
+public:
+    explicit SharedQueuePool(unsigned threadCount = thread::hardware_concurrency()) {
+        threadCount = max(threadCount, 1u);
+        for (unsigned i = 0; i < threadCount; ++i) {
+            threads.emplace_back([this]() {
+                unique_lock<mutex> guard(lock);
+                while (true) {
+                    if (runOne(guard)) continue;
+                    if (stopping && unfinished == 0) return;
+                    wake.wait(guard);
+                }
+            });
+        }
+    }
+
+    ~SharedQueuePool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    void submit(function<void()> task) {
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push_back(move(task));
+            ++unfinished;
+        }
+        wake.notify_one();
+    }
+
+    void yield(function<void()> task) {
+        submit(move(task));
+    }
+
+    void parallelFor(size_t n, size_t morsel, const function<void(size_t, size_t)>& body) {
+        if (n == 0) return;
+        morsel = max<size_t>(morsel, 1);
+        auto remaining = make_shared<atomic<size_t>>((n + morsel - 1) / morsel);
+        for (size_t lo = 0; lo < n; lo += morsel) {
+            size_t hi = min(n, lo + morsel);
+            submit([&body, remaining, lo, hi]() {
+                body(lo, hi);
+                (*remaining)--;
+            });
+        }
+        unique_lock<mutex> guard(lock);
+        while (*remaining > 0) {
+            if (!runOne(guard)) {
+                guard.unlock();
+                this_thread::yield();
+                guard.lock();
+            }
+        }
+    }
+
+    void waitIdle() {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [&]() { return unfinished == 0; });
+    }
+
+    unsigned size() const {
+        return unsigned(threads.size());
+    }
+
+    long long steals() const {
+        return 0;
+    }
+};
+
+#endif //WORKSTEALING_H
@@ -0,0 +1,528 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <new>
+#include <cstdlib>
+#include "CrimeDatabase.h"
+#include "WorkStealing.h"
+#include "PerfCounters.h"
+#include "LoadPipeline.h"
+
+using namespace std;
+
+// every operator new in the process is counted so a benchmark can report allocations per query
+static atomic<long long> allocations{0};
+
+[[gnu::noinline]] void* operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+// new and delete are not inlined, gcc otherwise warns that free() gets memory from operator new
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// a benchmark query, scans skip the result cache so every run does the work
+struct BenchQuery
+{
+    int type;
+    string argument;
+    int backend;
+};
+
+// skewed mix: a few long street scans clustered at the front, then many cheap lookups and counts
+vector<BenchQuery> skewedMix(const CrimeDatabase& db, int total, int scans)
+{
+    vector<BenchQuery> mix;
+    for (int i = 0; i < scans; ++i) {
+        const string& street = db.columns.streetNames[i % db.columns.streetNames.size()];
+        mix.push_back({STREET_QUERY, street, i % 2 ? SPLAY_BACKEND : MAP_BACKEND});
+    }
+    for (int i = scans; i < total; ++i) {
+        if (i % 4 == 0) {
+            mix.push_back({0, db.columns.areaNames[i % db.columns.areaNames.size()], 0});
+        } else {
+            mix.push_back({RECORD_QUERY, to_string((i * 7919) % db.size()), MAP_BACKEND});
+        }
+    }
+    return mix;
+}
+
+// count queries are marked with type 0
+template<typename Pool>
+size_t runOnPool(CrimeDatabase& db, Pool& pool, const BenchQuery& q)
+{
+    if (q.type == 0) {
+        return size_t(db.count(AREA_QUERY, q.argument));
+    }
+    if (q.type == RECORD_QUERY) {
+        return db.search(q.type, q.argument, q.backend).size();
+    }
+    return db.parallelSearch(pool, q.type, q.argument, q.backend).ids.size();
+}
+
+size_t runAlone(CrimeDatabase& db, const BenchQuery& q)
+{
+    if (q.type == 0) {
+        return size_t(db.count(AREA_QUERY, q.argument));
+    }
+    return db.search(q.type, q.argument, q.backend).size();
+}
+
+template<typename Pool>
+double poolRun(CrimeDatabase& db, const vector<BenchQuery>& mix, unsigned threads, long long* steals)
+{
+    Pool pool(threads);
+    atomic<size_t> found{0};
+    auto start = chrono::steady_clock::now();
+    for (auto &q : mix) {
+        pool.submit([&]() { found += runOnPool(db, pool, q); });
+    }
+    pool.waitIdle();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (steals) *steals = pool.steals();
+    return seconds;
+}
+
+// each thread takes one contiguous share of the queries
+double staticRun(CrimeDatabase& db, const vector<BenchQuery>& mix, unsigned threads)
+{
+    atomic<size_t> found{0};
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (unsigned w = 0; w < threads; ++w) {
+        workers.emplace_back([&, w]() {
+            size_t lo = mix.size() * w / threads, hi = mix.size() * (w + 1) / threads;
+            for (size_t i = lo; i < hi; ++i) {
+                found += runAlone(db, mix[i]);
+            }
+        });
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// throughput of a skewed query mix under a static split, a shared queue and work stealing
+void schedulerBench(CrimeDatabase& db, unsigned threads)
+{
+    vector<BenchQuery> mix = skewedMix(db, 20000, 16);
+    cout << "scheduler benchmark: " << mix.size() << " queries (16 street scans first), "
+         << threads << " threads\n";
+    auto report = [&](const string& name, double seconds, long long steals) {
+        cout << "  " << name << ": " << (long long)(mix.size() / seconds) << " queries/s ("
+             << (long long)(seconds * 1e3) << " ms";
+        if (steals >= 0) cout << ", " << steals << " steals";
+        cout << ")\n";
+    };
+    report("static split", staticRun(db, mix, threads), -1);
+    report("shared queue", poolRun<SharedQueuePool>(db, mix, threads, nullptr), -1);
+    long long steals = 0;
+    double seconds = poolRun<WorkStealingPool>(db, mix, threads, &steals);
+    report("work stealing", seconds, steals);
+}
+
+// load time of the serial loop against the pipelined load with 1..threads parsers, each
+// into a fresh database. busy times show how much of each stage overlapped the others
+void loadBench(const string& path, unsigned threads)
+{
+    cout << "load benchmark: " << path << "\n";
+    double serial;
+    {
+        CrimeDatabase db;
+        auto start = chrono::steady_clock::now();
+        db.load(path);
+        serial = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  serial: " << (long long)(serial * 1e3) << " ms for " << db.size() << " records\n";
+    }
+    {
+        // queries can start once load returns, the trees follow on their own thread
+        CrimeDatabase db;
+        db.treeMode = TREES_BACKGROUND;
+        auto start = chrono::steady_clock::now();
+        db.load(path);
+        double ready = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        while (!db.treeProgress().empty()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        double built = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  serial, trees in background: queries after " << (long long)(ready * 1e3)
+             << " ms, trees ready after " << (long long)(built * 1e3) << " ms\n";
+    }
+    vector<unsigned> counts;
+    for (unsigned parsers = 1; parsers < threads; parsers *= 2) {
+        counts.push_back(parsers);
+    }
+    counts.push_back(threads);
+    for (unsigned parsers : counts) {
+        CrimeDatabase db;
+        LoadStats stats;
+        pipelinedLoad(db, path, parsers, &stats);
+        double stages = stats.readSeconds + stats.parseSeconds + stats.recordSeconds + stats.mapSeconds + stats.finishSeconds;
+        cout << "  pipelined, " << parsers << " parser" << (parsers > 1 ? "s" : "") << ": "
+             << (long long)(stats.seconds * 1e3) << " ms (" << fixed << setprecision(2) << serial / stats.seconds
+             << "x), stage busy " << (long long)(stages * 1e3) << " ms: read " << (long long)(stats.readSeconds * 1e3)
+             << ", parse " << (long long)(stats.parseSeconds * 1e3) << ", records " << (long long)(stats.recordSeconds * 1e3)
+             << ", map " << (long long)(stats.mapSeconds * 1e3) << ", trees+cube " << (long long)(stats.finishSeconds * 1e3)
+             << "; full waits read " << stats.readFull << ", parse " << stats.parseFull << ", records " << stats.mapFull
+             << "; " << db.size() << " records\n";
+        cout.unsetf(ios::fixed);
+    }
+}
+
+// one row of the query benchmark, latencies in nanoseconds
+struct QueryResult
+{
+    string type;
+    string backend;
+    string workload;
+    bool warm;
+    int samples;
+    long long median;
+    long long p99;
+    double throughput;
+    double allocations;
+    // hardware counter per query, -1 where the counter isn't available or --perf is off
+    double perOp[PERF_EVENTS];
+};
+
+// set by --perf, counters are opened once on the main thread where queries are measured
+static PerfCounters* perf = nullptr;
+
+// results are added here so the searches can't be optimised away
+static volatile size_t sink = 0;
+
+enum Workload { UNIFORM = 0, ZIPF = 1, SEQUENTIAL = 2 };
+
+// ranks 0..n-1 with probability proportional to 1 / (rank + 1)
+class ZipfPicker {
+private:
+    vector<double> cumulative;
+public:
+    explicit ZipfPicker(size_t n) : cumulative(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += 1.0 / double(i + 1);
+            cumulative[i] = sum;
+        }
+    }
+    size_t pick(mt19937_64& rng) const {
+        double u = uniform_real_distribution<double>(0, cumulative.back())(rng);
+        return min(size_t(lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin()),
+                   cumulative.size() - 1);
+    }
+};
+
+// the arguments a query type can take: dictionary names, years in the data or record numbers
+vector<string> queryKeys(const CrimeDatabase& db, int type)
+{
+    vector<string> keys;
+    if (type == AREA_QUERY) {
+        keys = db.columns.areaNames;
+    } else if (type == STREET_QUERY) {
+        keys = db.columns.streetNames;
+    } else if (type == YEAR_QUERY) {
+        for (int y = db.columns.minYear; y <= db.columns.maxYear; ++y) keys.push_back(to_string(y));
+    } else {
+        for (int i = 0; i < db.size(); ++i) keys.push_back(to_string(i));
+    }
+    return keys;
+}
+
+// the same seed always gives the same sequence of arguments
+vector<string> workloadKeys(const vector<string>& keys, int workload, int samples, unsigned long long seed)
+{
+    mt19937_64 rng(seed);
+    vector<string> picked;
+    if (workload == ZIPF) {
+        // popular keys are shuffled so rank doesn't follow dictionary order
+        vector<size_t> order(keys.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        shuffle(order.begin(), order.end(), rng);
+        ZipfPicker zipf(keys.size());
+        for (int i = 0; i < samples; ++i) picked.push_back(keys[order[zipf.pick(rng)]]);
+    } else if (workload == UNIFORM) {
+        uniform_int_distribution<size_t> any(0, keys.size() - 1);
+        for (int i = 0; i < samples; ++i) picked.push_back(keys[any(rng)]);
+    } else {
+        size_t first = uniform_int_distribution<size_t>(0, keys.size() - 1)(rng);
+        for (int i = 0; i < samples; ++i) picked.push_back(keys[(first + i) % keys.size()]);
+    }
+    return picked;
+}
+
+// cold runs clear the result cache before every query so each one scans. warm runs go
+// through the cache after one untimed pass over the same arguments
+QueryResult measureQueries(CrimeDatabase& db, int type, int backend, int workload, bool warm,
+                           const vector<string>& args)
+{
+    auto run = [&](const string& arg) -> size_t {
+        if (warm) {
+            return db.cachedSearch(type, arg, backend)->size();
+        }
+        db.cache.clear();
+        return db.search(type, arg, backend).size();
+    };
+    size_t found = 0;
+    if (warm) {
+        for (auto &arg : args) found += run(arg);
+    }
+    vector<long long> latencies;
+    latencies.reserve(args.size());
+    long long allocated = allocations.load();
+    if (perf) perf->start();
+    auto start = chrono::steady_clock::now();
+    for (auto &arg : args) {
+        auto begin = chrono::steady_clock::now();
+        found += run(arg);
+        latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (perf) perf->stop();
+    allocated = allocations.load() - allocated;
+    sort(latencies.begin(), latencies.end());
+
+    const string typeNames[] = {"", "area", "street", "year", "record"};
+    const string workloadNames[] = {"uniform", "zipf", "sequential"};
+    QueryResult r;
+    r.type = typeNames[type];
+    r.backend = QueryMetrics::backendName(backend);
+    r.workload = workloadNames[workload];
+    r.warm = warm;
+    r.samples = int(args.size());
+    r.median = latencies[latencies.size() / 2];
+    r.p99 = latencies[min(latencies.size() - 1, size_t(ceil(latencies.size() * 0.99)) - 1)];
+    r.throughput = seconds > 0 ? args.size() / seconds : 0;
+    r.allocations = double(allocated) / args.size();
+    for (int e = 0; e < PERF_EVENTS; ++e) {
+        r.perOp[e] = perf && perf->available(e) ? double(perf->count(e)) / args.size() : -1;
+    }
+    sink = sink + found;
+    return r;
+}
+
+// every query type on every backend under uniform, zipf and sequential arguments, cold and warm
+vector<QueryResult> queryBench(CrimeDatabase& db, int samples, unsigned long long seed)
+{
+    vector<QueryResult> results;
+    cout << "query benchmark: " << samples << " queries per run, seed " << seed << "\n";
+    cout << "  type    backend    workload    cache   median ns      p99 ns     queries/s  allocs/query\n";
+    for (int type = AREA_QUERY; type <= RECORD_QUERY; ++type) {
+        vector<string> keys = queryKeys(db, type);
+        for (int workload = UNIFORM; workload <= SEQUENTIAL; ++workload) {
+            // every backend and both cache states see the same arguments
+            vector<string> args = workloadKeys(keys, workload, samples, seed + type * 10 + workload);
+            for (int backend = MAP_BACKEND; backend <= VERSIONED_BACKEND; ++backend) {
+                for (bool warm : {false, true}) {
+                    QueryResult r = measureQueries(db, type, backend, workload, warm, args);
+                    printf("  %-7s %-10s %-11s %-5s %11lld %11lld %13.0f %13.1f\n", r.type.c_str(),
+                           r.backend.c_str(), r.workload.c_str(), r.warm ? "warm" : "cold",
+                           r.median, r.p99, r.throughput, r.allocations);
+                    if (perf) {
+                        cout << "   ";
+                        for (int e = 0; e < PERF_EVENTS; ++e) {
+                            if (r.perOp[e] < 0) {
+                                printf(" %s n/a", perfEventName(e));
+                            } else {
+                                printf(" %s %.1f", perfEventName(e), r.perOp[e]);
+                            }
+                        }
+                        printf("\n");
+                    }
+                    results.push_back(r);
+                }
+            }
+        }
+    }
+    db.cache.clear();
+    cout << "splay tree after the query runs: ";
+    db.splayTree.printStats(cout);
+    return results;
+}
+
+// one writer appending small batches while readers scan by year, for every backend. map and
+// splay tree readers hold dataLock for a scan and the writer waits for them, versioned tree
+// readers pin a version and don't. appended rows are copies of loaded ones and stay in db
+void versionsBench(CrimeDatabase& db, unsigned threads, double seconds = 2)
+{
+    unsigned readers = max(threads, 2u);
+    const int BATCH = 64;
+    int loaded = db.size();
+    vector<string> years;
+    for (int y = db.columns.minYear; y <= db.columns.maxYear; ++y) {
+        years.push_back(to_string(y));
+    }
+    cout << "versions benchmark: 1 writer appending batches of " << BATCH << " records, " << readers
+         << " readers scanning, " << seconds << " s per backend\n";
+    cout << "  backend      scans/s    rows/s   append p50 ns   append p99 ns\n";
+    for (int backend = MAP_BACKEND; backend <= VERSIONED_BACKEND; ++backend) {
+        PersistentTreeStats before = db.versionedTree.stats();
+        atomic<bool> stop{false};
+        atomic<long long> scans{0};
+        atomic<size_t> found{0};
+        vector<thread> workers;
+        for (unsigned r = 0; r < readers; ++r) {
+            workers.emplace_back([&, r]() {
+                for (size_t i = r; !stop; ++i) {
+                    found.fetch_add(db.search(YEAR_QUERY, years[i % years.size()], backend).size(), memory_order_relaxed);
+                    scans.fetch_add(1, memory_order_relaxed);
+                }
+            });
+        }
+        // the writer is the only thread changing the record store, so it reads it unlocked
+        vector<CrimeRecord> batch(BATCH);
+        vector<long long> appendNs;
+        size_t pinned = 0;
+        long long rows = 0;
+        auto start = chrono::steady_clock::now();
+        while (chrono::duration<double>(chrono::steady_clock::now() - start).count() < seconds) {
+            for (int i = 0; i < BATCH; ++i) {
+                batch[i] = db.record(int((rows + i) % loaded));
+            }
+            auto t = chrono::steady_clock::now();
+            db.append(batch);
+            appendNs.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t).count());
+            rows += BATCH;
+            pinned = max(pinned, db.versionedTree.stats().retainedVersions);
+        }
+        stop = true;
+        for (auto &t : workers) {
+            t.join();
+        }
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        sink = sink + found;
+        sort(appendNs.begin(), appendNs.end());
+        printf("  %-10s %9.1f %9.0f %15lld %15lld\n", QueryMetrics::backendName(backend), scans / elapsed,
+               rows / elapsed, appendNs[appendNs.size() / 2],
+               appendNs[min(appendNs.size() - 1, size_t(ceil(appendNs.size() * 0.99)) - 1)]);
+        if (backend == VERSIONED_BACKEND) {
+            PersistentTreeStats after = db.versionedTree.stats();
+            uint64_t commits = after.commits - before.commits;
+            double copied = commits ? double(after.nodesCopied - before.nodesCopied) / commits : 0;
+            printf("  per version: %.1f nodes copied, %.0f bytes (%zu-byte nodes); at most %zu old versions"
+                   " pinned; %llu live nodes for %d records\n", copied, copied * after.nodeBytes, after.nodeBytes,
+                   pinned, (unsigned long long)after.liveNodes, db.size());
+        }
+    }
+}
+
+// one json object per run, meant to be kept next to the commit it was measured on
+bool writeJson(const string& path, const CrimeDatabase& db, int samples, unsigned long long seed,
+               const vector<QueryResult>& results)
+{
+    ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    out << "{\n  \"records\": " << db.size() << ",\n  \"samples\": " << samples
+        << ",\n  \"seed\": " << seed << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const QueryResult& r = results[i];
+        out << "    {\"type\": \"" << r.type << "\", \"backend\": \"" << r.backend
+            << "\", \"workload\": \"" << r.workload << "\", \"cache\": \"" << (r.warm ? "warm" : "cold")
+            << "\", \"samples\": " << r.samples << ", \"median_ns\": " << r.median
+            << ", \"p99_ns\": " << r.p99 << ", \"queries_per_s\": " << (long long)r.throughput
+            << ", \"allocs_per_query\": " << r.allocations;
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            if (r.perOp[e] >= 0) out << ", \"" << perfEventName(e) << "_per_query\": " << r.perOp[e];
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return bool(out);
+}
+
+int main(int argc, char* argv[])
+{
+    string dataPath = "CleanedCrimeData.csv";
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    int samples = 50;
+    unsigned long long seed = 1;
+    string jsonPath;
+    bool usePerf = false;
+    vector<string> benches;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        int value;
+        if (arg == "--data" && i + 1 < argc) {
+            dataPath = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc && parseInt(argv[i + 1], value) && value > 0) {
+            threads = unsigned(value);
+            ++i;
+        } else if (arg == "--samples" && i + 1 < argc && parseInt(argv[i + 1], value) && value > 0) {
+            samples = value;
+            ++i;
+        } else if (arg == "--seed" && i + 1 < argc && parseInt(argv[i + 1], value)) {
+            seed = (unsigned long long)value;
+            ++i;
+        } else if (arg == "--perf") {
+            usePerf = true;
+        } else if (arg == "--json" && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else if (arg == "queries" || arg == "scheduler" || arg == "load" || arg == "versions") {
+            benches.push_back(arg);
+        } else {
+            cerr << "usage: " << argv[0] << " [--data FILE] [--threads N] [--samples N] [--seed N] [--json FILE]"
+                 << " [--perf] [queries] [scheduler] [load] [versions]\n";
+            return 1;
+        }
+    }
+    if (benches.empty()) {
+        benches = {"queries", "scheduler"};
+    }
+
+    if (benches.size() == 1 && benches[0] == "load") {
+        loadBench(dataPath, threads);
+        return 0;
+    }
+
+    CrimeDatabase db;
+    if (!db.load(dataPath)) {
+        cerr << "file not found, make sure it's in cmake-build-debug folder\n";
+        return 1;
+    }
+    PerfCounters counters;
+    if (usePerf) {
+        perf = &counters;
+        if (!counters.any()) {
+            cerr << "hardware counters are not available here (perf_event_open denied or unsupported),"
+                 << " reporting wall clock only\n";
+        }
+    }
+    for (auto &name : benches) {
+        if (name == "queries") {
+            vector<QueryResult> results = queryBench(db, samples, seed);
+            if (!jsonPath.empty() && !writeJson(jsonPath, db, samples, seed, results)) {
+                cerr << "could not write " << jsonPath << "\n";
+                return 1;
+            }
+        } else if (name == "scheduler") {
+            schedulerBench(db, threads);
+        } else if (name == "load") {
+            loadBench(dataPath, threads);
+        } else if (name == "versions") {
+            versionsBench(db, threads);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include "CrimeRecord.h"
+
+using namespace std;
+
+// rows generated and written as one unit, each with its own random stream so the output
+// only depends on the seed and not on the number of threads
+const long long CHUNK_ROWS = 1 << 16;
+
+// distributions taken from a real file. every list holds one entry per sample row, so a
+// uniform pick from it follows the real frequencies. locations are kept per area so a
+// generated street belongs to its area
+struct CrimeModel
+{
+    vector<string> areaNames;
+    vector<int> areas;
+    vector<vector<string>> locations;
+    vector<pair<int, int>> yearMonths;
+    vector<int> times;
+    // crime description, victim age and premise, copied together
+    vector<string> middles;
+
+    bool load(const string& path) {
+        ifstream file(path);
+        if (!file) {
+            return false;
+        }
+        string line;
+        getline(file, line);
+        map<string, int> areaIndex;
+        while (getline(file, line)) {
+            stringstream ss(line);
+            string date, time, area, desc, age, premise, location;
+            getline(ss, date, ',');
+            getline(ss, time, ',');
+            getline(ss, area, ',');
+            getline(ss, desc, ',');
+            getline(ss, age, ',');
+            getline(ss, premise, ',');
+            getline(ss, location, ',');
+            int year = getYear(date), month = getMonth(date), t;
+            if (area.empty() || location.empty() || year == 0 || month == 0 || !parseInt(time, t)) {
+                continue;
+            }
+            auto found = areaIndex.find(area);
+            if (found == areaIndex.end()) {
+                found = areaIndex.emplace(area, int(areaNames.size())).first;
+                areaNames.push_back(area);
+                locations.emplace_back();
+            }
+            areas.push_back(found->second);
+            locations[found->second].push_back(location);
+            yearMonths.push_back({year, month});
+            times.push_back(t);
+            middles.push_back(desc + ',' + age + ',' + premise);
+        }
+        return !areas.empty();
+    }
+};
+
+// splitmix64, turns (seed, chunk) into independent generator seeds
+inline unsigned long long mixSeed(unsigned long long x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline int daysIn(int year, int month)
+{
+    static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return month == 2 && leap ? 29 : days[month - 1];
+}
+
+// same street with a new house number of the same length, "16334  ST  50" -> "20871  ST  50"
+inline void newHouseNumber(string& location, mt19937_64& rng)
+{
+    size_t digits = 0;
+    while (digits < location.size() && isdigit((unsigned char)location[digits])) {
+        ++digits;
+    }
+    for (size_t i = 0; i < digits; ++i) {
+        location[i] = char('0' + (i == 0 && digits > 1 ? 1 + rng() % 9 : rng() % 10));
+    }
+}
+
+// the csv text for the count rows of one chunk
+string generateChunk(const CrimeModel& model, unsigned long long seed, long long chunk, long long count)
+{
+    mt19937_64 rng(mixSeed(seed ^ mixSeed((unsigned long long)chunk)));
+    auto pick = [&rng](size_t n) { return size_t(rng() % n); };
+    string out;
+    out.reserve(size_t(count) * 80);
+    char date[32];
+    for (long long i = 0; i < count; ++i) {
+        int area = model.areas[pick(model.areas.size())];
+        const vector<string>& streets = model.locations[area];
+        string location = streets[pick(streets.size())];
+        newHouseNumber(location, rng);
+        pair<int, int> ym = model.yearMonths[pick(model.yearMonths.size())];
+        int day = 1 + int(pick(daysIn(ym.first, ym.second)));
+        snprintf(date, sizeof(date), "%02d/%02d/%04d 12:00:00 AM", ym.second, day, ym.first);
+        out += date;
+        out += ',';
+        out += to_string(model.times[pick(model.times.size())]);
+        out += ',';
+        out += model.areaNames[area];
+        out += ',';
+        out += model.middles[pick(model.middles.size())];
+        out += ',';
+        out += location;
+        out += '\n';
+    }
+    return out;
+}
+
+int main(int argc, char* argv[])
+{
+    string samplePath = "CleanedCrimeData.csv";
+    string outPath = "SyntheticCrimeData.csv";
+    long long rows = 1000000;
+    unsigned long long seed = 1;
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        int value;
+        if (arg == "--sample" && i + 1 < argc) {
+            samplePath = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            outPath = argv[++i];
+        } else if (arg == "--rows" && i + 1 < argc) {
+            // up to 1e9 rows, more digits than parseInt takes
+            string text = argv[++i];
+            rows = -1;
+            if (!text.empty() && text.size() <= 10 && text.find_first_not_of("0123456789") == string::npos) {
+                rows = stoll(text);
+            }
+            if (rows < 0 || rows > 1000000000LL) {
+                cerr << "--rows takes a number from 0 to 1000000000\n";
+                return 1;
+            }
+        } else if (arg == "--seed" && i + 1 < argc && parseInt(argv[i + 1], value)) {
+            seed = (unsigned long long)value;
+            ++i;
+        } else if (arg == "--threads" && i + 1 < argc && parseInt(argv[i + 1], value) && value > 0) {
+            threads = unsigned(value);
+            ++i;
+        } else {
+            cerr << "usage: " << argv[0] << " [--sample FILE] [--out FILE] [--rows N] [--seed N] [--threads N]\n";
+            return 1;
+        }
+    }
+
+    CrimeModel model;
+    if (!model.load(samplePath)) {
+        cerr << "could not read sample data from " << samplePath << "\n";
+        return 1;
+    }
+    FILE* out = outPath == "-" ? stdout : fopen(outPath.c_str(), "wb");
+    if (!out) {
+        cerr << "could not open " << outPath << "\n";
+        return 1;
+    }
+    fputs("DATE OCC,TIME OCC,AREA NAME,Crm Cd Desc,Vict Age,Premis Desc,LOCATION\n", out);
+
+    // workers take chunks in order and write them in order, so at most one finished chunk
+    // per worker is held in memory
+    auto start = chrono::steady_clock::now();
+    long long chunks = (rows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    atomic<long long> nextChunk{0};
+    long long nextWrite = 0;
+    bool failed = false;
+    mutex lock;
+    condition_variable turn;
+    vector<thread> workers;
+    for (unsigned w = 0; w < threads; ++w) {
+        workers.emplace_back([&]() {
+            while (true) {
+                long long chunk = nextChunk++;
+                if (chunk >= chunks) return;
+                long long count = min(CHUNK_ROWS, rows - chunk * CHUNK_ROWS);
+                string text = generateChunk(model, seed, chunk, count);
+                unique_lock<mutex> guard(lock);
+                turn.wait(guard, [&]() { return nextWrite == chunk; });
+                if (fwrite(text.data(), 1, text.size(), out) != text.size()) {
+                    failed = true;
+                }
+                ++nextWrite;
+                turn.notify_all();
+            }
+        });
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    if (fflush(out) != 0) {
+        failed = true;
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (failed) {
+        cerr << "write to " << outPath << " failed\n";
+        return 1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << rows << " rows written to " << outPath << " in " << (long long)(seconds * 1e3) << " ms\n";
+    return 0;
+}
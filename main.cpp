@@ -1,288 +1,493 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <string>
 #include <iomanip>
-#include <map>
 #include <vector>
-#include "SplayTree.h"
+#include "CrimeDatabase.h"
+#include "ResultWriter.h"
+#include "BatchRunner.h"
+#include "QueryServer.h"
+#include "Ingest.h"
+#include "LoadPipeline.h"
+#include "Reload.h"
+#include <fstream>
 #include <chrono>
+#include <cstring>
 
 using namespace std;
 
-struct CrimeRecord
+// every allocation of the program goes through the tracking allocator so memory can be
+// reported per component
+void* operator new(size_t size)
 {
-    string date;
-    string time;
-    string area;
-    string location;
-    int year;
+    return trackedAllocate(size);
+}
 
-};
+void operator delete(void* p) noexcept
+{
+    trackedRelease(p);
+}
 
-// helpers
-string removeExtraSpace(string check)
+void operator delete(void* p, size_t) noexcept
 {
-    string result;
-    bool inSpace = false;
+    trackedRelease(p);
+}
 
-    for (int i = 0; i < check.length(); ++i)
-    {
-        if (isspace(check[i]))
-        {
-            if (!inSpace)
-            {
-                result += ' ';
-                inSpace = true;
-            }
-        }
-        else
-        {
-            result += check[i];
-            inSpace = false;
+// read a menu number, 0 if the input wasn't a number
+int readChoice()
+{
+    int value;
+    cin >> value;
+    if (!cin) {
+        cin.clear();
+        value = 0;
+    }
+    cin.ignore(1e6,'\n');
+    return value;
+}
+
+// top k streets for every area (or one area)
+void runTopStreets(const CrimeDatabase& db)
+{
+    cout << "How many streets per area: ";
+    int k = readChoice();
+    if (k <= 0) {
+        cout << "Invalid number of streets.\n";
+        return;
+    }
+    cout << "1) Exact\n"
+         << "2) Streaming Estimate\n"
+         << "Choose method: ";
+    int method = readChoice();
+    if (method != 1 && method != 2) {
+        cout << "Invalid method.\n";
+        return;
+    }
+    string area;
+    cout << "Area Name (blank for all): ";
+    getline(cin, area);
+    int only = -1;
+    if (!removeExtraSpace(area).empty() && (only = db.columns.areaCode(area)) < 0) {
+        cout << "Unknown area.\n";
+        return;
+    }
+
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
+    vector<vector<StreetCount>> top = db.topStreets(k, method == 2);
+
+    auto end = steady_clock::now();
+    auto duration = duration_cast<nanoseconds>(end - start);
+
+    // names are read while rows may still be appended
+    shared_lock<RwLock> dataRead(db.dataLock);
+    for (size_t a = 0; a < top.size(); ++a) {
+        if (only >= 0 && int(a) != only) continue;
+        cout << "\n===== " << db.columns.areaNames[a] << " =====\n";
+        for (size_t i = 0; i < top[a].size(); ++i) {
+            cout << setw(3) << i + 1 << " | " << setw(25) << db.columns.streetNames[top[a][i].street]
+                 << " | " << top[a][i].count << "\n";
         }
     }
+    cout << "Top streets completed in " << duration.count() << " ns.\n";
+}
 
-    // Trim leading and trailing space
-    result.erase(0, result.find_first_not_of(' '));
-    result.erase(result.find_last_not_of(' ') + 1);
+// count queries never build a result list, only the counts are printed
+void runCountMenu(const CrimeDatabase& db)
+{
+    cout << "1) Count All\n"
+         << "2) Count by Area Name\n"
+         << "3) Count by Year\n"
+         << "4) Count by Hour\n"
+         << "5) Count by Month\n"
+         << "6) Top Streets per Area\n"
+         << "Choose count type: ";
+    int group = readChoice();
+    if (group == 6) {
+        runTopStreets(db);
+        return;
+    }
+    if (group < COUNT_ALL || group > COUNT_BY_MONTH) {
+        cout << "Invalid count type.\n";
+        return;
+    }
+    // blank answers don't filter
+    CountFilter filter;
+    cout << "Only count Area Name (blank for all): ";
+    getline(cin, filter.area);
+    cout << "Only count Street Location (blank for all): ";
+    getline(cin, filter.street);
+    cout << "Only count Year (blank for all): ";
+    getline(cin, filter.year);
+
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
+    vector<CountRow> rows = db.countBy(group, filter);
+
+    auto end = steady_clock::now();
+    auto duration = duration_cast<nanoseconds>(end - start);
 
-    return result;
+    cout << "\n===== Counts (" << rows.size() << ") =====\n";
+    for (auto &row : rows) {
+        cout << setw(20) << row.label << " | " << row.count << "\n";
+    }
+    cout << "Count completed in " << duration.count() << " ns.\n";
 }
 
-// convert to upper case for string comparison
-string toUpper(string check)
+// say why results couldn't be written, returns the exit status for it
+int outputError(const ResultWriter& out)
 {
-    for (size_t i = 0; i < check.size(); ++i)
-        check[i] = static_cast<char>(toupper(static_cast<unsigned char>(check[i])));
-    return check;
+    cerr << "could not write results: " << strerror(out.error()) << "\n";
+    return 1;
 }
 
-// remove starting numbers of location/space to help with searching for street
-string removeLeadingNumber(string check) {
-    size_t i = 0;
-    while (i < check.size() && (isdigit(static_cast<unsigned char>(check[i])) || isspace(static_cast<unsigned char>(check[i])))) {
-        ++i;
+// write the metrics snapshot and the trace if they were asked for, false if one couldn't be written
+bool writeSnapshots(const CrimeDatabase& db, const string& path, const string& tracePath)
+{
+    bool ok = true;
+    if (!path.empty() && !db.metrics.writeSnapshot(path)) {
+        cerr << "could not write metrics to " << path << "\n";
+        ok = false;
+    }
+    if (!tracePath.empty() && !Tracer::instance().writeChromeTrace(tracePath)) {
+        cerr << "could not write trace to " << tracePath << "\n";
+        ok = false;
     }
-    return check.substr(i);
+    return ok;
 }
 
-// get the year from the date of crime occurance
-int getYear(string date)
+// command line options
+struct Options
+{
+    Page page;
+    string dataPath = "CleanedCrimeData.csv";
+    // batch query file, "-" for stdin, empty for the interactive menu
+    string batchPath;
+    int threads = 1;
+    // server mode, unix socket path or loopback tcp port
+    string socketPath;
+    int port = 0;
+    // batch and server searches running longer are stopped, 0 for no limit
+    long long deadlineMs = 0;
+    // metrics snapshot written on exit, json for a .json name and prometheus text otherwise
+    string metricsPath;
+    // chrome trace of the whole run written on exit
+    string tracePath;
+    // out-of-core store directory, built from dataPath the first time
+    string diskPath;
+    int poolMb = 256;
+    // append-only csv and drop directory whose new rows are appended while running
+    string followPath;
+    string watchDir;
+    // parser threads of the pipelined load, 0 for the serial load, -1 to pick from the core count
+    int loadThreads = -1;
+    // map, splay tree and versioned tree built at load, in the background after it or on first use
+    int treeMode = TREES_BACKGROUND;
+};
+
+// parse the command line, false on anything unknown
+bool parseOptions(int argc, char* argv[], Options& options)
 {
-    size_t firstSlash = date.find('/');
-    if (firstSlash == string::npos) {
-        return -1;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        string next = argv[++i];
+        int value = 0;
+        bool number = parseInt(next, value) && value >= 0;
+        if (arg == "--limit" && number) {
+            options.page.limit = size_t(value);
+        } else if (arg == "--offset" && number) {
+            options.page.offset = size_t(value);
+        } else if (arg == "--threads" && number && value > 0) {
+            options.threads = value;
+        } else if (arg == "--data") {
+            options.dataPath = next;
+        } else if (arg == "--batch") {
+            options.batchPath = next;
+        } else if (arg == "--deadline-ms" && number) {
+            options.deadlineMs = value;
+        } else if (arg == "--disk") {
+            options.diskPath = next;
+        } else if (arg == "--pool-mb" && number && value > 0) {
+            options.poolMb = value;
+        } else if (arg == "--load-threads" && number) {
+            options.loadThreads = value;
+        } else if (arg == "--trees" && (next == "load" || next == "background" || next == "lazy")) {
+            options.treeMode = next == "load" ? TREES_AT_LOAD : next == "background" ? TREES_BACKGROUND : TREES_LAZY;
+        } else if (arg == "--follow") {
+            options.followPath = next;
+        } else if (arg == "--watch") {
+            options.watchDir = next;
+        } else if (arg == "--trace") {
+            options.tracePath = next;
+        } else if (arg == "--metrics") {
+            options.metricsPath = next;
+        } else if (arg == "--socket") {
+            options.socketPath = next;
+        } else if (arg == "--port" && number && value > 0 && value < 65536) {
+            options.port = value;
+        } else {
+            return false;
+        }
     }
-    size_t secondSlash = date.find('/', firstSlash + 1);
-    if (secondSlash == string::npos) {
-        return -1;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--data FILE] [--limit N] [--offset N] [--batch FILE|-] [--threads N] [--deadline-ms N]"
+             << " [--socket PATH | --port N] [--metrics FILE] [--trace FILE]"
+             << " [--disk DIR [--pool-mb N]] [--follow FILE] [--watch DIR]"
+             << " [--load-threads N] [--trees load|background|lazy]\n"
+             << "--trees only picks when the map, splay tree and versioned tree are built (background by default),"
+             << " the record store, columns, posting lists, count cube and time segments are always built"
+             << " before the first query\n";
+        return 1;
     }
 
-    size_t spaceAfterYear = date.find(' ', secondSlash);
-    string yearStr = date.substr(secondSlash + 1, spaceAfterYear - secondSlash - 1);
+    if (!options.tracePath.empty()) {
+        Tracer::instance().enable();
+    }
 
-    return stoi(yearStr);
-}
-// recursively insert middle, then left/right
-template<typename K, typename V>
-void buildBalanced(SplayTree<K,V>& tree, const vector<pair<K,V>>& data, int low, int high) {
-    if (low > high) return;
-    int mid = low + (high - low) / 2;
-    tree.rawInsert(data[mid].first, data[mid].second);
-    buildBalanced(tree, data, low, mid - 1);
-    buildBalanced(tree, data, mid + 1, high);
-}
+    // out-of-core mode, batch queries over segment files instead of loading the csv
+    if (!options.diskPath.empty()) {
+#ifdef __linux__
+        DiskStore store;
+        size_t poolBytes = size_t(options.poolMb) << 20;
+        if (!store.open(options.diskPath, poolBytes)) {
+            cerr << "converting " << options.dataPath << " into " << options.diskPath << "\n";
+            if (!DiskStore::build(options.dataPath, options.diskPath) || !store.open(options.diskPath, poolBytes)) {
+                cerr << "could not build the out-of-core store\n";
+                return 1;
+            }
+        }
+        if (options.batchPath.empty()) {
+            cerr << "out-of-core mode runs batch queries, give --batch FILE\n";
+            return 1;
+        }
+        ResultWriter diskOut;
+        if (options.batchPath == "-") {
+            return runDiskBatch(store, cin, diskOut) ? 0 : outputError(diskOut);
+        }
+        ifstream batch(options.batchPath);
+        if (!batch) {
+            cerr << "batch file not found: " << options.batchPath << "\n";
+            return 1;
+        }
+        return runDiskBatch(store, batch, diskOut) ? 0 : outputError(diskOut);
+#else
+        cerr << "out-of-core mode needs linux\n";
+        return 1;
+#endif
+    }
 
-int main() {
-    // load csv file
-    ifstream file("CleanedCrimeData.csv");
-    if (!file)
+    // load csv file. with enough cores parsing and index building overlap, on one or two
+    // the threads would only take turns
+    auto first = make_unique<CrimeDatabase>();
+    first->treeMode = options.treeMode;
+    unsigned cores = thread::hardware_concurrency();
+    int parsers = options.loadThreads >= 0 ? options.loadThreads : cores >= 4 ? int(min(cores / 2, 4u)) : 0;
+    bool loaded = parsers > 0 ? pipelinedLoad(*first, options.dataPath, unsigned(parsers)) : first->load(options.dataPath);
+    if (!loaded)
     {
         cerr << "file not found, make sure it's in cmake-build-debug folder\n";
         return 1;
     }
-    // skip header line
-    string line;
-    getline(file, line);
+    // queries pin the current snapshot, a reload publishes the next one beside it
+    DatabaseStore data(move(first));
 
-    int count = 0;
+    // new rows keep coming in on their own thread while any mode runs
+#ifdef __linux__
+    CsvIngest ingest(data);
+    if (!options.followPath.empty()) {
+        // the loaded file continues where load stopped, any other file from its header
+        ingest.follow(options.followPath, options.followPath == options.dataPath);
+    }
+    if (!options.watchDir.empty() && !ingest.watch(options.watchDir)) {
+        cerr << "could not watch " << options.watchDir << "\n";
+        return 1;
+    }
+    if (!options.followPath.empty() || !options.watchDir.empty()) {
+        ingest.start();
+    }
+#else
+    if (!options.followPath.empty() || !options.watchDir.empty()) {
+        cerr << "following files needs linux\n";
+        return 1;
+    }
+#endif
 
-    // red black tree implementation as a map
-    map<int, CrimeRecord> rbTree;
-    vector<pair<int,CrimeRecord>> allRecords;
+    // one output buffer for the whole session
+    ResultWriter out;
 
-    while (getline(file, line))
-    {
-        stringstream ss(line);
-        CrimeRecord rec;
-        string skip;
-
-        // taking in data from csv
-        getline(ss, rec.date, ','); // date occurred
-        getline(ss, rec.time, ','); // time occurred
-        getline(ss, rec.area, ','); // area
-        // skip columns to get to location column
-        for (int i = 0; i < 3; ++i) {
-            getline(ss, skip, ',');
+    // server mode, the dataset stays loaded while clients query it
+    if (!options.socketPath.empty() || options.port != 0) {
+#ifdef __linux__
+        DatasetReloader reloader(data, options.dataPath, parsers);
+        QueryServer server(data, options.threads, options.deadlineMs);
+        server.onReload([&reloader]() {
+            return reloader.start() ? string("reload started\n") : "reload already running: " + reloader.status() + "\n";
+        });
+        bool listening = options.socketPath.empty() ? server.listenTcp(options.port) : server.listenUnix(options.socketPath);
+        if (!listening) {
+            cerr << "could not listen on " << (options.socketPath.empty() ? to_string(options.port) : options.socketPath) << "\n";
+            return 1;
         }
-        getline(ss, rec.location, ',');
-        rec.area = removeExtraSpace(rec.area);
-        rec.location = removeExtraSpace(rec.location);
-        rec.year = getYear(rec.date);
-
-        // insert into map
-        rbTree[count] = rec;
-        // insert into splay tree
-        allRecords.push_back(make_pair(count, rec));
-        ++count;
+        cerr << "serving " << data.pin()->size() << " records with " << options.threads << " workers\n";
+        cerr << server.run();
+        cerr << reloader.status() << "\n";
+        return writeSnapshots(*data.pin(), options.metricsPath, options.tracePath) ? 0 : 1;
+#else
+        cerr << "server mode needs linux\n";
+        return 1;
+#endif
     }
-    file.close();
 
-    // build balanced splay tree
-    SplayTree<int,CrimeRecord> splayTree;
-    buildBalanced(splayTree, allRecords, 0, int(allRecords.size()) - 1);
+    // batch mode, one output line per query. the whole batch runs on one snapshot
+    if (!options.batchPath.empty()) {
+        DatabasePin pin = data.pin();
+        CrimeDatabase& db = *pin;
+        if (options.batchPath == "-") {
+            if (!runBatch(db, cin, options.threads, out, options.deadlineMs)) {
+                return outputError(out);
+            }
+            return writeSnapshots(db, options.metricsPath, options.tracePath) ? 0 : 1;
+        }
+        ifstream batch(options.batchPath);
+        if (!batch) {
+            cerr << "batch file not found: " << options.batchPath << "\n";
+            return 1;
+        }
+        if (!runBatch(db, batch, options.threads, out, options.deadlineMs)) {
+            return outputError(out);
+        }
+        return writeSnapshots(db, options.metricsPath, options.tracePath) ? 0 : 1;
+    }
 
     // menu loop
     while (true) {
+        DatabasePin pin = data.pin();
+        CrimeDatabase& db = *pin;
         cout << "\n===== Crime Search Menu =====\n"
              << "Search for grand theft auto crimes in the LA area\n"
              << "Results will be shown as: Date | Time | Area Name | Street Location\n"
              << "\n1) Search by Area Name\n"
              << "2) Search by Street Location\n"
              << "3) Search by Year\n"
-             << "4) Search by Record Number (0-122091)\n"
-             << "5) Exit\n"
-             << "\nChoose an option: ";
+             << "4) Search by Record Number (0-" << db.size() - 1 << ")\n"
+             << "5) Count Incidents\n"
+             << "6) Show Metrics\n"
+             << "7) Exit\n";
+        string building = db.treeProgress();
+        if (!building.empty()) {
+            cout << "\nTrees: " << building << "\n"
+                 << "(searches on a tree that isn't ready scan the records)\n";
+        }
+        cout << "\nChoose an option: ";
         int choice;
         cin >> choice;
-        if (!cin || choice < 1 || choice > 5) {
+        if (!cin || choice < 1 || choice > 7) {
             cin.clear();
             cin.ignore(1e6,'\n');
             cout << "Invalid choice.\n";
             continue;
         }
-        if (choice == 5) {
+        if (choice == 7) {
             break;
         }
         cin.ignore(1e6,'\n');
 
+        if (choice == 6) {
+            cout << "\n===== Metrics =====\n" << db.metrics.text();
+            cout << "\n===== Memory =====\n" << db.memoryReport();
+            cout << "\n===== Splay Tree =====\n";
+            if (db.treeBuilt(SPLAY_BACKEND)) {
+                shared_lock<shared_mutex> readLock(db.splayLock);
+                db.splayTree.printStats(cout);
+            } else {
+                cout << "not built yet\n";
+            }
+            if (!options.metricsPath.empty() && writeSnapshots(db, options.metricsPath, "")) {
+                cout << "Snapshot written to " << options.metricsPath << ".\n";
+            }
+            continue;
+        }
+
+        if (choice == 5) {
+            runCountMenu(db);
+            continue;
+        }
+
         // get query string or number
         string query;
-        int recordNumber = 0;
-        if (choice == 4) {
-            cout << "Enter record number: ";
-            cin >> recordNumber;
-            cin.ignore(1e6,'\n');
-        } else {
-            string prompts[] = {
-                "",
-                "Enter Area Name: ",
-                "Enter Street Location: ",
-                "Enter Year: ",
-                ""
-            };
-            cout << prompts[choice];
-            getline(cin, query);
-        }
+        string prompts[] = {
+            "",
+            "Enter Area Name: ",
+            "Enter Street Location: ",
+            "Enter Year: ",
+            "Enter record number: "
+        };
+        cout << prompts[choice];
+        getline(cin, query);
 
-        // choose data structure
+        // choose data structure, years can also be read from their time segments
         cout << "1) Map\n"
              << "2) SplayTree\n"
-             << "Choose Data Structure: ";
-        int ds;
-        cin >> ds;
-        cin.ignore(1e6,'\n');
-        if (ds != 1 && ds != 2) {
+             << "3) Versioned Tree\n";
+        if (choice == YEAR_QUERY) {
+            cout << "4) Time Segments\n";
+        }
+        cout << "Choose Data Structure: ";
+        int ds = readChoice();
+        if (ds != MAP_BACKEND && ds != SPLAY_BACKEND && ds != VERSIONED_BACKEND
+            && (ds != SEGMENT_BACKEND || choice != YEAR_QUERY)) {
             cout << "Invalid Data Structure Choice.\n";
             continue;
         }
 
-        // perform search
-        vector<CrimeRecord> results;
-
+        // perform search, results are record numbers
         using namespace std::chrono;
         auto start = steady_clock::now();
 
-        if (choice == 1) {
-            // by Area
-            string Q = toUpper(removeExtraSpace(query));
-            if (ds == 1) {
-                for (auto &p: rbTree) {
-                    if (toUpper(removeExtraSpace(p.second.area)) == Q)
-                        results.push_back(p.second);
-                }
-            } else {
-                splayTree.forEach([&](int k, CrimeRecord& r){
-                    if (toUpper(removeExtraSpace(r.area)) == Q)
-                        results.push_back(r);
-                });
-            }
-        }
-        else if (choice == 2) {
-            // by Street
-            string Q = toUpper(removeLeadingNumber(removeExtraSpace(query)));
-            if (ds == 1) {
-                for (auto &p: rbTree) {
-                    if (toUpper(removeLeadingNumber(p.second.location)) == Q)
-                        results.push_back(p.second);
-                }
-            } else {
-                splayTree.forEach([&](int k, CrimeRecord& r){
-                    if (toUpper(removeLeadingNumber(r.location)) == Q)
-                        results.push_back(r);
-                });
-            }
-        }
-        else if (choice == 3) {
-            // by Year
-            string Q = removeExtraSpace(query);
-            int year = stoi(Q);
-            if (ds == 1)
-            {
-                for (auto &p: rbTree)
-                {
-                    if(p.second.year == year)
-                    {
-                        results.push_back(p.second);
-                    }
-                }
-            }
-            else
-            {
-                splayTree.forEach([&](int k, CrimeRecord& r){
-                    if (r.year == year)
-                        results.push_back(r);
-                });
-            }
-        }
-        else if (choice == 4) {
-            // by Record Number
-            if (ds == 1) {
-                auto it = rbTree.find(recordNumber);
-                if (it != rbTree.end()) results.push_back(it->second);
-            } else {
-                CrimeRecord* rp = splayTree.find(recordNumber);
-                if (rp) results.push_back(*rp);
-            }
-        }
+        bool cacheHit;
+        shared_ptr<const vector<int>> found = db.cachedSearch(choice, query, ds, &cacheHit);
+        const vector<int>& results = *found;
 
         auto end = steady_clock::now();
         auto duration = duration_cast<nanoseconds>(end - start);
+        db.metrics.recordQuery(choice, ds, duration.count());
 
-        // display results
+        // display results, fields are only fetched for the rows on the page
         cout << "\n===== Results (" << results.size() << ") =====\n";
-        for (auto &r : results) {
-            cout << setw(15) << r.date
-                 << " | " << setw(6)  << r.time
-                 << " | " << setw(12) << r.area
-                 << " | " << setw(20) << r.location << "\n";
+        cout.flush();
+        out.resetTimes();
+        long long bytesBefore = out.bytesWritten();
+        shared_lock<RwLock> dataRead(db.dataLock);
+        size_t shown = writePage(out, results, options.page, [&](int id) -> const CrimeRecord& {
+            return db.record(id);
+        });
+        if (!out.flush()) {
+            outputError(out);
+        }
+        dataRead.unlock();
+        db.metrics.bytesFormatted.fetch_add(uint64_t(out.bytesWritten() - bytesBefore), memory_order_relaxed);
+        if (shown < results.size()) {
+            cout << "Showing " << shown << " rows starting at row " << min(options.page.offset, results.size()) << ".\n";
         }
-        cout << "Search completed in " << duration.count() << " ns.\n";
+        cout << "Search completed in " << duration.count() << " ns"
+             << " (cache " << (choice == RECORD_QUERY ? "bypassed" : cacheHit ? "hit" : "miss") << ", hit ratio " << fixed << setprecision(1)
+             << db.cache.hitRatio() * 100 << "% of " << db.cache.hits() + db.cache.misses() << " lookups).\n";
+        cout.unsetf(ios::fixed);
+        cout << "Formatted in " << out.formatTime() << " ns, printed in " << out.writeTime() << " ns.\n";
         cout << "\n===== Results (" << results.size() << ") =====\n";
     }
 
+    writeSnapshots(*data.pin(), options.metricsPath, options.tracePath);
     cout << "Exiting.\n";
 
     return 0;
-}
\ No newline at end of file
+}
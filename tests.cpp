@@ -0,0 +1,676 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <thread>
+#include <csignal>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+#include "CrimeDatabase.h"
+#include "BatchRunner.h"
+#include "LoadPipeline.h"
+#include "BoundedRing.h"
+#include "Ingest.h"
+
+using namespace std;
+
+// count allocations per component so the checks can read the memory account
+void* operator new(size_t size)
+{
+    return trackedAllocate(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    trackedRelease(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    trackedRelease(p);
+}
+
+// checks print the failing expression and the test keeps going, main returns 1 if any failed
+static int failures = 0;
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #expr << "\n"; \
+            ++failures; \
+        } \
+    } while (0)
+
+// a database with every tree built, filled through append from csv lines
+static unique_ptr<CrimeDatabase> databaseOf(const vector<string>& lines)
+{
+    auto db = make_unique<CrimeDatabase>();
+    for (int backend = MAP_BACKEND; backend <= VERSIONED_BACKEND; ++backend) {
+        db->buildTree(backend);
+    }
+    vector<CrimeRecord> recs(lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        parseCrimeLine(lines[i], recs[i]);
+    }
+    db->append(recs);
+    return db;
+}
+
+// more scans suspended at once than an epoch domain has slots in a block, for the
+// snapshot store and for the versioned tree (every other job). every job
+// holds a pin while suspended, the next pin has to come from a new block and not wait
+// for them
+static void suspendedReadersBeyondSlots()
+{
+    vector<string> lines;
+    for (int i = 0; i < 8; ++i) {
+        lines.push_back("10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET," + to_string(100 + i) + "  MAIN  ST");
+    }
+    DatabaseStore store(databaseOf(lines));
+    size_t jobs = 2 * EpochDomain::SLOTS + 100;
+    vector<unique_ptr<BatchJob>> running;
+    for (size_t j = 0; j < jobs; ++j) {
+        BatchQuery q;
+        string backend = j % 2 ? "versioned" : "map";
+        parseBatchLine("street " + backend + " " + to_string(j) + " Main St", int(j) + 1, q);
+        running.push_back(make_unique<BatchJob>(store.pin(), q, QueryControl{}, 1));
+        // one record per slice, so the first step leaves the scan suspended
+        CHECK(!running.back()->step());
+    }
+    // a publish meanwhile must not free the snapshot the jobs still use
+    store.publish(databaseOf(lines));
+    CHECK(store.retired() == 1);
+    for (auto &job : running) {
+        while (!job->step()) {
+        }
+        CHECK(job->output().find("| 8 results |") != string::npos);
+    }
+    running.clear();
+    store.reclaim();
+    CHECK(store.retired() == 0);
+}
+
+// a retired snapshot frees its trees once reclaimed, so repeated reloads of the same data
+// leave each tree holding what one copy needs
+static void reloadsFreeRetiredTrees()
+{
+    vector<string> lines;
+    for (int i = 0; i < 500; ++i) {
+        lines.push_back("10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET," + to_string(100 + i) + "  MAIN  ST");
+    }
+    MemoryAccount& account = memoryAccount();
+    DatabaseStore store(databaseOf(lines));
+    long long splay = account.liveBytes[MEM_SPLAY];
+    long long map = account.liveBytes[MEM_MAP];
+    long long versioned = account.liveBytes[MEM_VERSIONED];
+    CHECK(splay > 0);
+    for (int reload = 0; reload < 4; ++reload) {
+        store.publish(databaseOf(lines));
+        store.reclaim();
+    }
+    CHECK(store.retired() == 0);
+    CHECK(account.liveBytes[MEM_SPLAY] == splay);
+    CHECK(account.liveBytes[MEM_MAP] == map);
+    CHECK(account.liveBytes[MEM_VERSIONED] == versioned);
+}
+
+// a last line without its newline is loaded but not counted in loadedBytes, both loaders
+static void loadStopsAtLastNewline()
+{
+    string header = "Date,Time,Area,Crime,Age,Premis,Location\n";
+    string row = "10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST\n";
+    string path = "lagta_tests_partial.csv";
+    {
+        ofstream out(path, ios::binary);
+        out << header << row << row << "10/28/2021 12:00:00 AM,258,Oly";
+    }
+    long long complete = (long long)(header.size() + 2 * row.size());
+    CrimeDatabase plain;
+    CHECK(plain.load(path));
+    CHECK(plain.size() == 3);
+    CHECK(plain.loadedPartial);
+    CHECK(plain.loadedBytes == complete);
+    CrimeDatabase piped;
+    CHECK(pipelinedLoad(piped, path, 2));
+    CHECK(piped.size() == 3);
+    CHECK(piped.loadedPartial);
+    CHECK(piped.loadedBytes == complete);
+#ifdef __linux__
+    // following the file skips the loaded row once its newline is written
+    DatabaseStore store(make_unique<CrimeDatabase>());
+    CHECK(store.pin()->load(path));
+    CsvIngest ingest(store);
+    ingest.follow(path, true);
+    {
+        ofstream out(path, ios::binary | ios::app);
+        out << "mpic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST\n" << row;
+    }
+    CHECK(ingest.pollOnce() == 1);
+    CHECK(store.pin()->size() == 4);
+#endif
+    remove(path.c_str());
+}
+
+// rows appended while the trees are built in the background end up in every tree,
+// in order after the loaded ones
+static void appendsDuringTreeBuild()
+{
+    string path = "lagta_tests_build.csv";
+    {
+        ofstream out(path, ios::binary);
+        out << "Date,Time,Area,Crime,Age,Premis,Location\n";
+        for (int i = 0; i < 30000; ++i) {
+            out << "10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET," << i % 500 << "  MAIN  ST\n";
+        }
+    }
+    CrimeDatabase db;
+    db.treeMode = TREES_BACKGROUND;
+    CHECK(db.load(path));
+    vector<CrimeRecord> recs(50);
+    for (auto &rec : recs) {
+        parseCrimeLine("11/02/2022 12:00:00 AM,1930,Central,BURGLARY,0,STREET,200  SPRING  ST", rec);
+    }
+    for (int batch = 0; batch < 20; ++batch) {
+        db.append(recs);
+        this_thread::yield();
+    }
+    while (!db.treeBuilt(MAP_BACKEND) || !db.treeBuilt(SPLAY_BACKEND) || !db.treeBuilt(VERSIONED_BACKEND)) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    CHECK(db.size() == 31000);
+    for (int backend = MAP_BACKEND; backend <= VERSIONED_BACKEND; ++backend) {
+        vector<int> ids = db.search(STREET_QUERY, "Spring St", backend);
+        CHECK(ids.size() == 1000);
+        CHECK(!ids.empty() && ids.front() == 30000 && ids.back() == 30999);
+        CHECK(db.search(RECORD_QUERY, "30999", backend).size() == 1);
+        CHECK(db.search(AREA_QUERY, "Olympic", backend).size() == 30000);
+    }
+    CHECK(db.versionedTree.pin().size() == 31000);
+    remove(path.c_str());
+}
+
+// a put from a search that started before an append neither goes in nor drops the
+// entries of the newer version
+static void staleCachePutIsDropped()
+{
+    QueryCache cache;
+    auto ids = make_shared<const vector<int>>(vector<int>{1, 2, 3});
+    cache.put("new", 2, ids);
+    cache.put("old", 1, ids);
+    CHECK(cache.size() == 1);
+    CHECK(cache.get("new", 2) == ids);
+    CHECK(cache.get("old", 1) == nullptr);
+    CHECK(cache.get("new", 2) == ids);
+    CHECK(cache.get("new", 3) == nullptr);
+    CHECK(cache.size() == 0);
+}
+
+static string rowsText(const vector<CountRow>& rows)
+{
+    string out;
+    for (auto &row : rows) {
+        out += row.label + "=" + to_string(row.count) + " ";
+    }
+    return out;
+}
+
+// a row whose time doesn't parse is counted under "Unknown" by hour and still in every
+// total, the same from the count cube as from the street counting scan, whether the
+// cube was built at load or filled by appends
+static void malformedTimeCounted()
+{
+    string row = "10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST";
+    string bad = "10/28/2021 12:00:00 AM,noon,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST";
+    string path = "lagta_tests_malformed.csv";
+    {
+        ofstream out(path, ios::binary);
+        out << "Date,Time,Area,Crime,Age,Premis,Location\n" << row << "\n" << row << "\n" << bad << "\n";
+    }
+    CrimeDatabase loaded;
+    CHECK(loaded.load(path));
+    remove(path.c_str());
+    auto appended = databaseOf({row, row, bad});
+    for (CrimeDatabase* db : {&loaded, appended.get()}) {
+        CountFilter none, area{"Olympic", "", ""}, areaYear{"Olympic", "", "2021"};
+        CountFilter street{"", "Main St", ""}, streetYear{"", "Main St", "2021"};
+        CHECK(rowsText(db->countBy(COUNT_ALL, area)) == "Total=3 ");
+        CHECK(rowsText(db->countBy(COUNT_ALL, areaYear)) == "Total=3 ");
+        CHECK(rowsText(db->countBy(COUNT_ALL, streetYear)) == "Total=3 ");
+        CHECK(rowsText(db->countBy(COUNT_BY_AREA, areaYear)) == "Olympic=3 ");
+        CHECK(rowsText(db->countBy(COUNT_BY_HOUR, none)) == "02:00=2 Unknown=1 ");
+        CHECK(rowsText(db->countBy(COUNT_BY_HOUR, street)) == "02:00=2 Unknown=1 ");
+        CHECK(rowsText(db->countBy(COUNT_BY_MONTH, areaYear)) == "Oct=3 ");
+        CHECK(rowsText(db->countBy(COUNT_BY_MONTH, streetYear)) == "Oct=3 ");
+    }
+}
+
+// with every record on one street the street filter keeps them all, so the counting
+// scan over the columns has to give the rows the count cube gives without it. both are
+// checked against counting the records by hand
+static void cubeMatchesCountingScan()
+{
+    string areas[] = {"Olympic", "Pacific", "Central"};
+    string path = "lagta_tests_counts.csv";
+    {
+        ofstream out(path, ios::binary);
+        out << "Date,Time,Area,Crime,Age,Premis,Location\n";
+        for (int i = 0; i < 2000; ++i) {
+            string date = to_string(i % 12 + 1) + "/" + to_string(i % 28 + 1) + "/" + to_string(2019 + i % 5);
+            if (i % 97 == 0) date = "13/01/2021";
+            string time = i % 89 == 0 ? "noon" : to_string(i % 24 * 100 + i % 60);
+            out << date << " 12:00:00 AM," << time << "," << areas[i % 3] << ",BURGLARY,0,STREET,100  MAIN  ST\n";
+        }
+    }
+    CrimeDatabase db;
+    CHECK(db.load(path));
+    remove(path.c_str());
+
+    for (const string& area : {string(""), string("Pacific")}) {
+        for (const string& year : {string(""), string("2021")}) {
+            CountFilter cube{area, "", year}, scan{area, "Main St", year};
+            for (int group = COUNT_ALL; group <= COUNT_BY_MONTH; ++group) {
+                CHECK(rowsText(db.countBy(group, cube)) == rowsText(db.countBy(group, scan)));
+            }
+        }
+    }
+
+    map<string, long long> hours;
+    long long pacific2021 = 0;
+    for (int id = 0; id < db.size(); ++id) {
+        const CrimeRecord& rec = db.record(id);
+        int hour = getHour(rec.time);
+        hours[hour < 0 ? "Unknown" : (hour < 10 ? "0" : "") + to_string(hour) + ":00"]++;
+        pacific2021 += rec.area == "Pacific" && getYear(rec.date) == 2021;
+    }
+    string expected;
+    for (auto &[label, n] : hours) {
+        if (label != "Unknown") expected += label + "=" + to_string(n) + " ";
+    }
+    expected += "Unknown=" + to_string(hours["Unknown"]) + " ";
+    CHECK(rowsText(db.countBy(COUNT_BY_HOUR, CountFilter{"", "Main St", ""})) == expected);
+    CHECK(rowsText(db.countBy(COUNT_ALL, CountFilter{"Pacific", "", "2021"})) == "Total=" + to_string(pacific2021) + " ");
+    CHECK(rowsText(db.countBy(COUNT_BY_YEAR, CountFilter{"Olympic", "", ""})).find("Unknown=") != string::npos);
+}
+
+// exact top k per area against counting by hand, on one thread and on several, and the
+// streaming top k against the exact one. noise streets come first, the heavy ones are
+// seen far more than rows / capacity times so space-saving has to keep them, and the
+// estimates only ever overcount
+static void streamingTopKFindsHeavyStreets()
+{
+    CrimeColumns columns;
+    CrimeIndex index;
+    StreamingTopK stream(16);
+    string areas[] = {"Olympic", "Pacific", "Central"};
+    vector<pair<int, string>> rows;
+    for (int a = 0; a < 3; ++a) {
+        for (int noise = 0; noise < 200; ++noise) {
+            rows.push_back({a, to_string(noise) + " SIDE ST"});
+        }
+    }
+    for (int a = 0; a < 3; ++a) {
+        for (int round = 0; round < 40 * (a + 1); ++round) {
+            for (int heavy = 0; heavy < 10; ++heavy) {
+                if (round < (40 - 3 * heavy) * (a + 1)) {
+                    rows.push_back({a, "100 STREET " + to_string(heavy)});
+                }
+            }
+        }
+    }
+    map<pair<int, int>, long long> truth;
+    for (auto &[a, location] : rows) {
+        CrimeRecord rec;
+        rec.date = "10/28/2021";
+        rec.time = "1200";
+        rec.area = areas[a];
+        rec.location = location;
+        rec.year = 2021;
+        int id = columns.size();
+        columns.add(rec);
+        index.add(id, columns);
+        stream.add(columns.area[id], columns.street[id]);
+        truth[{columns.area[id], columns.street[id]}]++;
+    }
+
+    vector<vector<StreetCount>> single = topStreetsExact(columns, index, 5, 1);
+    vector<vector<StreetCount>> spread = topStreetsExact(columns, index, 5, 3);
+    CHECK(single.size() == 3);
+    for (int a = 0; a < int(single.size()); ++a) {
+        vector<StreetCount> expected;
+        for (auto &[key, n] : truth) {
+            if (key.first == a) expected.push_back({key.second, n});
+        }
+        sort(expected.begin(), expected.end(), byCountDesc);
+        expected.resize(5);
+        CHECK(single[a].size() == 5 && spread[a].size() == 5);
+        for (size_t i = 0; i < expected.size() && i < single[a].size() && i < spread[a].size(); ++i) {
+            CHECK(single[a][i].street == expected[i].street && single[a][i].count == expected[i].count);
+            CHECK(spread[a][i].street == expected[i].street && spread[a][i].count == expected[i].count);
+        }
+        vector<StreetCount> approx = stream.top(a, 3);
+        CHECK(approx.size() == 3);
+        for (size_t i = 0; i < approx.size(); ++i) {
+            CHECK(approx[i].street == expected[i].street);
+            CHECK(approx[i].count >= expected[i].count);
+        }
+    }
+    CHECK(stream.top(3, 3).empty());
+    CHECK(topStreetsExact(columns, index, 0, 2)[0].empty());
+}
+
+// searches of one type and backend share a scan, years on the segments and queries that
+// can't match stay out of it. a shared search past its deadline stops on every backend without results
+static void sharedScanFiltersAndStops()
+{
+    vector<string> lines;
+    for (int i = 0; i < 3 * int(DEFAULT_SLICE); ++i) {
+        lines.push_back("10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET," + to_string(100 + i) + "  MAIN  ST");
+    }
+    auto db = databaseOf(lines);
+    vector<BatchQuery> queries(4);
+    parseBatchLine("area map Olympic", 1, queries[0]);
+    parseBatchLine("area map Pacific", 2, queries[1]);
+    parseBatchLine("year segments 2021", 3, queries[2]);
+    parseBatchLine("year map twenty", 4, queries[3]);
+    vector<string> out(queries.size());
+    vector<bool> handled = runSharedScans(*db, queries, out, nullptr);
+    CHECK(handled[0] && handled[1] && !handled[2] && !handled[3]);
+    CHECK(out[0].find(to_string(lines.size()) + " results (shared scan of 2)") != string::npos);
+
+    // the trees, then the record store of a database without them
+    CrimeDatabase noTrees;
+    vector<CrimeRecord> recs(lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        parseCrimeLine(lines[i], recs[i]);
+    }
+    noTrees.append(recs);
+    vector<pair<CrimeDatabase*, int>> scans = {{db.get(), MAP_BACKEND}, {db.get(), SPLAY_BACKEND},
+                                               {db.get(), VERSIONED_BACKEND}, {&noTrees, MAP_BACKEND}};
+    for (auto &[target, backend] : scans) {
+        QueryControl expired;
+        expired.deadline = chrono::steady_clock::now() - chrono::milliseconds(1);
+        int status = QUERY_DONE;
+        auto results = target->sharedSearch(YEAR_QUERY, {"2021", "2020"}, backend, expired, &status);
+        CHECK(status == QUERY_TIMED_OUT);
+        CHECK(results.empty());
+    }
+}
+
+// every batch line format, and the lines that are skipped or rejected with an error
+static void batchLinesParse()
+{
+    BatchQuery q;
+    CHECK(!parseBatchLine("", 1, q));
+    CHECK(!parseBatchLine("   \t ", 2, q));
+    CHECK(!parseBatchLine("# area map Pacific", 3, q));
+
+    CHECK(parseBatchLine("  AREA   Map   west  la ", 4, q));
+    CHECK(q.error.empty() && q.line == 4 && q.text == "AREA Map west la");
+    CHECK(q.type == AREA_QUERY && q.backend == MAP_BACKEND && q.argument == "west la");
+    CHECK(parseBatchLine("street splaytree 1300 Sepulveda Bl", 5, q));
+    CHECK(q.error.empty() && q.type == STREET_QUERY && q.backend == SPLAY_BACKEND && q.argument == "1300 Sepulveda Bl");
+    CHECK(parseBatchLine("record versioned 17", 6, q));
+    CHECK(q.error.empty() && q.type == RECORD_QUERY && q.backend == VERSIONED_BACKEND && q.argument == "17");
+    CHECK(parseBatchLine("year segments 2022", 7, q));
+    CHECK(q.error.empty() && q.type == YEAR_QUERY && q.backend == SEGMENT_BACKEND);
+
+    CHECK(parseBatchLine("count month area=Pacific;year=2022", 8, q));
+    CHECK(q.error.empty() && q.isCount && q.group == COUNT_BY_MONTH);
+    CHECK(q.filter.area == "Pacific" && q.filter.street.empty() && q.filter.year == "2022");
+    CHECK(parseBatchLine("count all", 9, q));
+    CHECK(q.error.empty() && q.isCount && q.group == COUNT_ALL);
+    CHECK(parseBatchLine("count hour street=Sepulveda Bl;", 10, q));
+    CHECK(q.error.empty() && q.group == COUNT_BY_HOUR && q.filter.street == "Sepulveda Bl");
+
+    CHECK(parseBatchLine("range 2022", 11, q));
+    CHECK(q.error.empty() && q.isRange && q.range.dateLo == 20220101 && q.range.dateHi == 20221231);
+    CHECK(parseBatchLine("range 01/01/2021..06/30/2021 area=Pacific;time=2200-2359", 12, q));
+    CHECK(q.error.empty() && q.range.dateLo == 20210101 && q.range.dateHi == 20210630);
+    CHECK(q.filter.area == "Pacific" && q.range.timeLo == 2200 && q.range.timeHi == 2359);
+    CHECK(parseBatchLine("range 2020..03/15/2021", 13, q));
+    CHECK(q.error.empty() && q.range.dateLo == 20200101 && q.range.dateHi == 20210315);
+
+    pair<string, string> rejected[] = {
+        {"burglary map Pacific", "unknown query type"},
+        {"area hash Pacific", "unknown data structure"},
+        {"area", "unknown data structure"},
+        {"street segments Main St", "segments only answer year searches"},
+        {"count week", "unknown count group"},
+        {"count area crime=burglary", "unknown count filter"},
+        {"range 2022..soon", "bad date range"},
+        {"range 13/01/2021", "bad date range"},
+        {"range 2021 time=2500-0100", "unknown range filter"},
+        {"range 2021 place=Pacific", "unknown range filter"},
+    };
+    for (auto &[line, error] : rejected) {
+        CHECK(parseBatchLine(line, 14, q));
+        CHECK(q.error == error);
+    }
+}
+
+// a ring fills up and empties at its capacity, keeps order across many laps of its
+// cells, and with several producers and consumers at once every value comes out exactly
+// once, each producer's in the order it pushed them
+static void boundedRingUnderProducers()
+{
+    CHECK(BoundedRing<int>(5).capacity() == 8);
+    CHECK(BoundedRing<int>(1).capacity() == 2);
+
+    BoundedRing<string> ring(4);
+    string value;
+    CHECK(!ring.tryPop(value));
+    for (int lap = 0; lap < 10; ++lap) {
+        for (int i = 0; i < 4; ++i) {
+            value = to_string(lap * 4 + i);
+            CHECK(ring.tryPush(value));
+        }
+        string extra = "extra";
+        CHECK(!ring.tryPush(extra));
+        CHECK(extra == "extra");
+        for (int i = 0; i < 4; ++i) {
+            CHECK(ring.tryPop(value) && value == to_string(lap * 4 + i));
+        }
+        CHECK(!ring.tryPop(value));
+    }
+
+    const int producers = 4, consumers = 3, each = 20000;
+    BoundedRing<int> shared(8);
+    vector<vector<int>> seen(consumers);
+    vector<thread> threads;
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&, c]() {
+            int v;
+            while (shared.pop(v)) {
+                seen[c].push_back(v);
+            }
+        });
+    }
+    vector<thread> pushing;
+    for (int p = 0; p < producers; ++p) {
+        pushing.emplace_back([&, p]() {
+            for (int i = 0; i < each; ++i) {
+                shared.push(p * each + i);
+            }
+        });
+    }
+    for (auto &t : pushing) t.join();
+    shared.close();
+    for (auto &t : threads) t.join();
+
+    vector<int> count(producers * each, 0);
+    for (auto &values : seen) {
+        vector<int> last(producers, -1);
+        for (int v : values) {
+            CHECK(v >= 0 && v < producers * each);
+            if (v < 0 || v >= producers * each) continue;
+            ++count[v];
+            CHECK(v > last[v / each]);
+            last[v / each] = v;
+        }
+    }
+    CHECK(all_of(count.begin(), count.end(), [](int n) { return n == 1; }));
+    int v;
+    CHECK(!shared.pop(v));
+}
+
+// cached results show up as the query cache in the memory account and the report, and
+// leave it once the cache lets go of them
+static void cacheInMemoryReport()
+{
+    vector<string> lines;
+    for (int i = 0; i < 5000; ++i) {
+        lines.push_back("10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET," + to_string(100 + i) + "  MAIN  ST");
+    }
+    auto db = databaseOf(lines);
+    MemoryAccount& account = memoryAccount();
+    long long before = account.liveBytes[MEM_CACHE];
+    long long resultBytes = (long long)(lines.size() * sizeof(int));
+    {
+        shared_ptr<const vector<int>> ids = db->cachedSearch(AREA_QUERY, "Olympic", MAP_BACKEND);
+        CHECK(ids->size() == lines.size());
+        CHECK(account.liveBytes[MEM_CACHE] - before >= resultBytes);
+    }
+    string report = db->memoryReport();
+    CHECK(report.find("query cache ") != string::npos);
+    long long held = account.liveBytes[MEM_CACHE];
+    db->cache.clear();
+    // the hash table keeps its buckets
+    CHECK(held - account.liveBytes[MEM_CACHE] >= resultBytes);
+}
+
+// a year search on the segments reads only that year's segments and finds what a scan
+// of any backend finds. each backend keeps its own cache entry and metrics series
+static void yearSearchUsesSegments()
+{
+    vector<string> lines;
+    for (int i = 0; i < 300; ++i) {
+        string date = i % 3 ? "10/28/2021" : "03/02/2020";
+        lines.push_back(date + " 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET," + to_string(100 + i) + "  MAIN  ST");
+    }
+    auto db = databaseOf(lines);
+    size_t scanned = 0;
+    vector<int> ids = db->yearSearch("2020", &scanned);
+    CHECK(ids.size() == 100);
+    CHECK(scanned == 100);
+    const QuerySeries* segments = db->metrics.at(YEAR_QUERY, SEGMENT_BACKEND);
+    CHECK(segments->rowsScanned.load() == 100);
+    CHECK(segments->rowsMatched.load() == 100);
+    for (int backend = MAP_BACKEND; backend <= VERSIONED_BACKEND; ++backend) {
+        CHECK(db->search(YEAR_QUERY, "2020", backend) == ids);
+    }
+    CHECK(db->yearSearch("twenty").empty());
+    BatchQuery q;
+    parseBatchLine("year segments 2021", 1, q);
+    CHECK(runBatchQuery(*db, q).find("| 200 results (200 of 300 rows scanned) |") != string::npos);
+    parseBatchLine("year splay 2021", 2, q);
+    CHECK(runBatchQuery(*db, q).find("| 200 results |") != string::npos);
+    CHECK(db->metrics.at(YEAR_QUERY, SPLAY_BACKEND)->latency.count() == 1);
+    parseBatchLine("area segments Olympic", 3, q);
+    CHECK(q.error == "segments only answer year searches");
+    parseBatchLine("range 2021", 4, q);
+    CHECK(runBatchQuery(*db, q).find("| 200 results (200 of 300 rows scanned) |") != string::npos);
+    CHECK(db->metrics.at(RANGE_QUERY, SEGMENT_BACKEND)->rowsScanned.load() == 200);
+    CHECK(db->metrics.at(RANGE_QUERY, MAP_BACKEND) == nullptr);
+    CHECK(*db->cachedSearch(YEAR_QUERY, "2021", MAP_BACKEND) == db->search(YEAR_QUERY, "2021", MAP_BACKEND));
+    CHECK(db->cachedSearch(AREA_QUERY, "Olympic", SEGMENT_BACKEND)->empty());
+    // a date the segments can't place has no year either
+    CrimeRecord rec;
+    CHECK(!parseCrimeLine("13/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST", rec));
+    CHECK(rec.year == -1);
+}
+
+#ifdef __linux__
+// a non-blocking pipe fills up, flush waits for the reader and loses nothing. writing
+// to a pipe with no reader fails and says why
+static void writerRetriesAndReports()
+{
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    size_t total = 0;
+    thread reader([&]() {
+        char chunk[4096];
+        ssize_t n;
+        while ((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+            total += size_t(n);
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+    });
+    {
+        ResultWriter out(fds[1], 1 << 20);
+        out.text(string(1 << 20, 'x'));
+        CHECK(out.flush());
+        CHECK(out.bytesWritten() == 1 << 20);
+    }
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+    CHECK(total == 1 << 20);
+
+    signal(SIGPIPE, SIG_IGN);
+    CHECK(pipe(fds) == 0);
+    close(fds[0]);
+    ResultWriter broken(fds[1]);
+    broken.text("lost\n");
+    CHECK(!broken.flush());
+    CHECK(broken.error() == EPIPE);
+    close(fds[1]);
+}
+
+// rows dropped into a watched directory with a date that isn't one are skipped and
+// counted, the rest still go in
+static void ingestSkipsMalformedDates()
+{
+    string dir = "lagta_tests_drop";
+    filesystem::remove_all(dir);
+    filesystem::create_directory(dir);
+    {
+        ofstream out(dir + "/rows.csv", ios::binary);
+        out << "Date,Time,Area,Crime,Age,Premis,Location\n"
+            << "10/28/2021 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST\n"
+            << "10/28/20x1 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST\n"
+            << "10/28/ 12:00:00 AM,258,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST\n"
+            << "not a date,258,Olympic,VEHICLE - STOLEN,0,STREET,100  MAIN  ST\n"
+            << "11/02/2022 12:00:00 AM,1930,Central,BURGLARY,0,STREET,200  SPRING  ST\n";
+    }
+    DatabaseStore store(make_unique<CrimeDatabase>());
+    CsvIngest ingest(store);
+    CHECK(ingest.watch(dir));
+    CHECK(ingest.pollOnce() == 2);
+    CHECK(store.pin()->size() == 2);
+    CHECK(store.pin()->metrics.rowsSkipped.load() == 3);
+    filesystem::remove_all(dir);
+}
+#endif
+
+int main()
+{
+    suspendedReadersBeyondSlots();
+    reloadsFreeRetiredTrees();
+    loadStopsAtLastNewline();
+    appendsDuringTreeBuild();
+    staleCachePutIsDropped();
+    malformedTimeCounted();
+    cubeMatchesCountingScan();
+    streamingTopKFindsHeavyStreets();
+    sharedScanFiltersAndStops();
+    yearSearchUsesSegments();
+    batchLinesParse();
+    boundedRingUnderProducers();
+    cacheInMemoryReport();
+#ifdef __linux__
+    writerRetriesAndReports();
+    ingestSkipsMalformedDates();
+#endif
+    if (failures > 0) {
+        cerr << failures << " checks failed\n";
+        return 1;
+    }
+    cout << "all tests passed\n";
+    return 0;
+}